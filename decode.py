@@ -0,0 +1,75 @@
+"""Convert raw device samples to calibrated per-channel float arrays.
+
+Uses the SIMD kernels in host/libtivadecode.so (build it with ``make -C
+host``) and falls back to numpy when the library isn't there. Both give the
+same results.
+"""
+
+import ctypes
+import os
+import numpy as np
+
+U12 = 0
+U16 = 1
+S16 = 2
+
+_lib_path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                         'host', 'libtivadecode.so')
+
+try:
+    _lib = ctypes.CDLL(_lib_path)
+    _lib.decode.restype = ctypes.c_int
+    _lib.decode.argtypes = [ctypes.c_int, ctypes.c_void_p, ctypes.c_size_t,
+                            ctypes.c_uint, ctypes.c_void_p, ctypes.c_void_p,
+                            ctypes.c_void_p]
+    _lib.decode_impl_name.restype = ctypes.c_char_p
+except OSError:
+    _lib = None
+
+
+def impl_name():
+    """Name of the decode implementation in use."""
+    if _lib is None:
+        return 'numpy'
+    return _lib.decode_impl_name().decode()
+
+
+def _unpack_numpy(raw, fmt):
+    if fmt == U12:
+        b = np.frombuffer(raw, dtype=np.uint8)
+        b = b[:len(b) - len(b) % 3].reshape(-1, 3).astype(np.uint16)
+        out = np.empty(2 * len(b), dtype=np.uint16)
+        out[0::2] = b[:, 0] | ((b[:, 1] & 0x0f) << 8)
+        out[1::2] = (b[:, 1] >> 4) | (b[:, 2] << 4)
+        return out
+    return np.frombuffer(raw, dtype='<u2' if fmt == U16 else '<i2')
+
+
+def decode(raw, fmt, nchan=1, gain=1.0, offset=0.0):
+    """Decode interleaved samples into an (nchan, nframes) float32 array.
+
+    Each value is computed as ``raw * gain + offset`` with per-channel gain
+    and offset (scalars apply to every channel).
+    """
+    bits = 12 if fmt == U12 else 16
+    nsamples = len(raw) * 8 // bits
+    nsamples -= nsamples % nchan
+    gain = np.broadcast_to(np.asarray(gain, dtype=np.float32), (nchan,))
+    offset = np.broadcast_to(np.asarray(offset, dtype=np.float32), (nchan,))
+    out = np.empty((nchan, nsamples // nchan), dtype=np.float32)
+
+    if _lib is None:
+        samples = _unpack_numpy(raw, fmt)[:nsamples].astype(np.float32)
+        samples = samples.reshape(-1, nchan).T
+        out[:] = samples * gain[:, None] + offset[:, None]
+        return out
+
+    src = np.frombuffer(raw, dtype=np.uint8)
+    gain = np.ascontiguousarray(gain)
+    offset = np.ascontiguousarray(offset)
+    rows = (ctypes.c_void_p * nchan)(*[out[ch].ctypes.data
+                                       for ch in range(nchan)])
+    if _lib.decode(fmt, src.ctypes.data, nsamples, nchan, gain.ctypes.data,
+                   offset.ctypes.data, rows):
+        raise ValueError('bad format or channel count')
+    return out
@@ -0,0 +1,142 @@
+/*
+ * bench_decode.c - Check and time the decode kernels.
+ *
+ * Usage: bench_decode [nchan [aggregate rate in Msps]]
+ *
+ * Every implementation the CPU supports is first checked against the scalar
+ * reference on a range of lengths (to exercise the tail handling), then timed
+ * on a large buffer. The last column is the fraction of one core needed to
+ * keep up with the given aggregate sample rate.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "decode.h"
+
+#define BENCH_SAMPLES (1 << 22)
+#define BENCH_SECONDS 0.5
+
+static const char *format_names[] = { "u12", "u16", "s16" };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(decode_format_t fmt, const uint8_t *raw, size_t nsamples,
+                unsigned nchan, const float *gain, const float *offset,
+                float *const *dst) {
+    if (decode(fmt, raw, nsamples, nchan, gain, offset, dst) != 0) {
+        fprintf(stderr, "decode() rejected %s with %u channels\n",
+                format_names[fmt], nchan);
+        exit(1);
+    }
+}
+
+// Compare against the scalar reference for every length up to a few blocks,
+// stepping in whole frames (and whole pairs for the packed format).
+static int check(decode_impl_t impl, decode_format_t fmt, const uint8_t *raw,
+                 unsigned nchan, const float *gain, const float *offset,
+                 float **ref, float **out) {
+    size_t step = (fmt == DECODE_U12 && nchan % 2) ? 2 * nchan : nchan;
+    size_t n, ch, i;
+
+    for (n = step; n <= 3000 + step; n += step) {
+        decode_select(DECODE_IMPL_SCALAR);
+        run(fmt, raw, n, nchan, gain, offset, ref);
+        decode_select(impl);
+        run(fmt, raw, n, nchan, gain, offset, out);
+
+        for (ch = 0; ch < nchan; ch++) {
+            for (i = 0; i < n / nchan; i++) {
+                if (memcmp(&ref[ch][i], &out[ch][i], sizeof(float)) != 0) {
+                    printf("  MISMATCH %s n=%zu ch=%zu i=%zu: %g != %g\n",
+                           format_names[fmt], n, ch, i, out[ch][i], ref[ch][i]);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned nchan = (argc > 1) ? (unsigned)atoi(argv[1]) : 4;
+    double rate = (argc > 2) ? atof(argv[2]) : 8.0;
+    decode_impl_t impls[] = {
+        DECODE_IMPL_SCALAR, DECODE_IMPL_SSE2, DECODE_IMPL_AVX2,
+    };
+    double scalar_ns[3] = { 0 };
+    size_t nsamples = BENCH_SAMPLES - BENCH_SAMPLES % (2 * nchan);
+    uint8_t *raw;
+    float *gain, *offset;
+    float **ref, **out;
+    unsigned ch, fmt, k;
+    size_t i;
+    int failed = 0;
+
+    if ((nchan == 0) || (nchan > DECODE_MAX_CHANNELS)) {
+        fprintf(stderr, "nchan must be from 1 to %d\n", DECODE_MAX_CHANNELS);
+        return 2;
+    }
+
+    raw = malloc(nsamples * 2 + 16);
+    gain = malloc(nchan * sizeof(float));
+    offset = malloc(nchan * sizeof(float));
+    ref = malloc(nchan * sizeof(float*));
+    out = malloc(nchan * sizeof(float*));
+
+    srand(1);
+    for (i = 0; i < nsamples * 2 + 16; i++) {
+        raw[i] = (uint8_t)rand();
+    }
+    for (ch = 0; ch < nchan; ch++) {
+        gain[ch] = 3.3f / 4096 * (1.0f + 0.01f * ch);
+        offset[ch] = -1.65f + 0.001f * ch;
+        ref[ch] = malloc(nsamples / nchan * sizeof(float));
+        out[ch] = malloc(nsamples / nchan * sizeof(float));
+    }
+
+    printf("%u channels, %.1f Msps aggregate\n", nchan, rate);
+    printf("%-8s %-4s %10s %9s %8s %8s\n",
+           "impl", "fmt", "Msps", "ns/samp", "speedup", "core");
+
+    for (k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (decode_select(impls[k]) != 0) {
+            continue;
+        }
+
+        for (fmt = DECODE_U12; fmt <= DECODE_S16; fmt++) {
+            double t0, t, ns;
+            unsigned reps = 0;
+
+            if (check(impls[k], fmt, raw, nchan, gain, offset, ref, out)) {
+                failed = 1;
+                continue;
+            }
+
+            decode_select(impls[k]);
+            t0 = now();
+            do {
+                run(fmt, raw, nsamples, nchan, gain, offset, out);
+                reps++;
+                t = now() - t0;
+            } while (t < BENCH_SECONDS);
+
+            ns = t * 1e9 / ((double)reps * nsamples);
+            if (impls[k] == DECODE_IMPL_SCALAR) {
+                scalar_ns[fmt] = ns;
+            }
+            printf("%-8s %-4s %10.1f %9.3f %7.1fx %7.2f%%\n",
+                   decode_impl_name(), format_names[fmt], 1e3 / ns, ns,
+                   scalar_ns[fmt] / ns, rate * ns * 0.1);
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,265 @@
+/*
+ * check_channels.c - Check the device's ADC sequencer handling.
+ *
+ * Usage: check_channels
+ *
+ * Builds src/channels.c for the host against the TivaWare headers, with the
+ * ADC registers it touches replaced by a model of sequencer 0's FIFO, then
+ * feeds ADC0SS0IntHandler() ticks' worth of results and checks every block
+ * channels_read() hands back. Covers all eight steps of the sequencer in use
+ * on every tick, mixed divisors, ticks the interrupt came too late for, and
+ * triggers that came while the interrupt was reprogramming the sequencer.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "inc/hw_adc.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_timer.h"
+#include "inc/hw_types.h"
+
+// The FIFO of sequencer 0, its overflow flag, and somewhere for every other
+// register access to go.
+static uint32_t fifo[16];
+static uint32_t fifo_head;
+static uint32_t fifo_count;
+static uint32_t fifo_status;
+static uint32_t fifo_value;
+static uint32_t overflow;
+static uint32_t other;
+
+// Timer 0A's timeout flag as the interrupt sees it after reprogramming
+static uint32_t timeout;
+
+static volatile uint32_t *check_reg(uint32_t address) {
+    switch (address) {
+    case ADC0_BASE + ADC_O_SSFIFO0:
+        fifo_value = fifo_count ? fifo[fifo_head++] : 0;
+        fifo_count -= fifo_count ? 1 : 0;
+        return &fifo_value;
+    case ADC0_BASE + ADC_O_SSFSTAT0:
+        fifo_status = fifo_count ? 0 : ADC_SSFSTAT0_EMPTY;
+        return &fifo_status;
+    case ADC0_BASE + ADC_O_OSTAT:
+        return &overflow;
+    default:
+        return &other;
+    }
+}
+
+#undef HWREG
+#define HWREG(x) (*check_reg(x))
+
+// channels.c keeps its state to itself, so it is built in here.
+#include "../src/channels.c"
+
+void ADCIntClear(uint32_t base, uint32_t sequence) {}
+void ADCIntEnable(uint32_t base, uint32_t sequence) {}
+void ADCSequenceConfigure(uint32_t base, uint32_t sequence, uint32_t trigger,
+                          uint32_t priority) {}
+void ADCSequenceDisable(uint32_t base, uint32_t sequence) {}
+void ADCSequenceEnable(uint32_t base, uint32_t sequence) {}
+void GPIOPinTypeADC(uint32_t port, uint8_t pins) {}
+void IntEnable(uint32_t interrupt) {}
+bool IntMasterDisable(void) { return false; }
+bool IntMasterEnable(void) { return false; }
+void IntPrioritySet(uint32_t interrupt, uint8_t priority) {}
+uint32_t SysCtlClockGet(void) { return 50000000; }
+void SysCtlPeripheralEnable(uint32_t periph) {}
+void TimerConfigure(uint32_t base, uint32_t config) {}
+void TimerControlTrigger(uint32_t base, uint32_t timer, bool enable) {}
+void TimerDisable(uint32_t base, uint32_t timer) {}
+void TimerEnable(uint32_t base, uint32_t timer) {}
+void TimerIntClear(uint32_t base, uint32_t flags) {}
+uint32_t TimerIntStatus(uint32_t base, bool masked) { return timeout; }
+void TimerLoadSet(uint32_t base, uint32_t timer, uint32_t value) {}
+bool sched_signal(uint32_t event) { return true; }
+
+// what a channel converts on a tick
+static uint16_t sample(uint32_t ain, uint32_t tick) {
+    return (uint16_t)((ain * 257 + tick) & ADC_SSFIFO0_DATA_M);
+}
+
+// Run one tick: put `extra` more (or fewer) results than are due in the
+// FIFO, garbled if asked, set the overflow flag if asked, and take the
+// interrupt.
+static void tick(const channels_cmd_t *config, uint32_t t, int32_t extra,
+                 bool garbled, bool overflowed) {
+    uint32_t c;
+    uint32_t n = 0;
+
+    fifo_head = 0;
+    for (c = 0; c < config->nchannels; c++) {
+        if ((t % config->channel[c].divisor) == 0) {
+            fifo[n++] = garbled ? 0xFFF : sample(config->channel[c].ain, t);
+        }
+    }
+    if (n == 0) {
+        fifo[n++] = 0;
+    }
+    while (extra > 0) {
+        fifo[n++] = 0xFFF;
+        extra--;
+    }
+    fifo_count = n + extra;
+    overflow = overflowed ? ADC_OSTAT_OV0 : 0;
+
+    ADC0SS0IntHandler();
+}
+
+// Read every finished block, checking it against what was converted. The
+// `held` ticks from `lost` (none if lost is ~0) should hold each channel's
+// value from before them. Returns the number of mismatches.
+static uint32_t check_blocks(const channels_cmd_t *config, uint32_t *blocks,
+                             uint32_t lost, uint32_t held) {
+    uint8_t payload[CHANNELS_PAYLOAD_MAX];
+    samples_header_t *header = (samples_header_t*)payload;
+    uint16_t *samples = (uint16_t*)(payload + sizeof(*header));
+    uint32_t timestamp;
+    uint32_t divisor;
+    uint32_t errors = 0;
+    uint32_t t;
+    uint32_t i;
+    uint16_t want;
+
+    while (channels_read(payload, &timestamp)) {
+        divisor = config->channel[header->channel].divisor;
+        if (header->block != blocks[header->channel]++) {
+            printf("  channel %u: block %u out of order\n", header->channel,
+                   (unsigned)header->block);
+            errors++;
+        }
+
+        for (i = 0; i < header->nsamples; i++) {
+            t = (header->block * CHANNELS_BLOCK + i) * divisor;
+            if ((lost != ~0u) && (t >= lost) && (t < lost + held)) {
+                want = (lost >= divisor) ?
+                    sample(header->ain, (lost - 1) / divisor * divisor) : 0;
+            }
+            else {
+                want = sample(header->ain, t);
+            }
+            if (samples[i] != want) {
+                if (errors < 10) {
+                    printf("  channel %u tick %u: got %u, want %u\n",
+                           header->channel, (unsigned)t, samples[i], want);
+                }
+                errors++;
+            }
+        }
+    }
+
+    return errors;
+}
+
+typedef struct {
+    const char *name;
+    uint8_t nchannels;
+    uint16_t divisors[CHANNELS_MAX];
+    uint32_t lost;          // tick the interrupt is late for, or ~0
+    int32_t extra;          // results more (or fewer) than due then
+    bool overflowed;        // whether the FIFO overflowed then
+    bool torn;              // or whether the next trigger came while the
+                            // interrupt was reprogramming the sequencer
+} test_t;
+
+static const test_t tests[] = {
+    { "8 channels, all every tick", 8, { 1, 1, 1, 1, 1, 1, 1, 1 }, ~0u, 0, 0 },
+    { "8 channels, one every 2nd tick", 8, { 1, 1, 1, 1, 1, 1, 1, 2 }, ~0u, 0, 0 },
+    { "mixed divisors", 4, { 1, 2, 4, 4 }, ~0u, 0, 0 },
+    { "8 channels, late by a result", 8, { 1, 1, 1, 1, 1, 1, 1, 1 }, 40, 1, 0 },
+    { "8 channels, FIFO overflowed", 8, { 1, 1, 1, 1, 1, 1, 1, 1 }, 40, 0, 1 },
+    { "mixed divisors, mid-conversion", 4, { 1, 2, 4, 4 }, 40, -1, 0 },
+    { "8 channels, trigger mid-program", 8, { 1, 1, 1, 1, 1, 1, 1, 2 },
+      40, -1, 0, 1 },
+    { "4 channels, trigger mid-program", 4, { 1, 2, 4, 4 },
+      41, 1, 0, 1 },
+};
+
+int main(void) {
+    channels_cmd_t config;
+    uint32_t blocks[CHANNELS_MAX];
+    uint32_t failures = 0;
+    uint32_t overruns;
+    uint32_t errors;
+    uint32_t ticks;
+    uint32_t lost;
+    uint32_t held;
+    uint32_t t;
+    uint32_t i;
+
+    channels_init(0);
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        const test_t *test = &tests[i];
+
+        memset(&config, 0, sizeof(config));
+        config.cmd = CMD_SET_CHANNELS;
+        config.nchannels = test->nchannels;
+        config.base_hz = 1000;
+        for (t = 0; t < test->nchannels; t++) {
+            config.channel[t].ain = t;
+            config.channel[t].divisor = test->divisors[t];
+        }
+        if (!channels_config(&config, 50000)) {
+            printf("%-32s config rejected\n", test->name);
+            failures++;
+            continue;
+        }
+
+        memset(blocks, 0, sizeof(blocks));
+        overruns = channels_overruns();
+        channels_start();
+
+        // A late interrupt loses its own tick and the next; a trigger
+        // while reprogramming only loses the tick it was for.
+        lost = test->torn ? test->lost + 1 : test->lost;
+        held = test->torn ? 1 : 2;
+
+        errors = 0;
+        ticks = 4 * CHANNELS_BLOCK * 4;
+        for (t = 0; t < ticks; t++) {
+            if (test->torn && (t == test->lost)) {
+                timeout = TIMER_TIMA_TIMEOUT;
+                tick(&config, t, 0, false, false);
+                timeout = 0;
+            }
+            else if (test->torn && (t == lost)) {
+                tick(&config, t, test->extra, true, false);
+            }
+            else if (t == test->lost) {
+                tick(&config, t, test->extra, false, test->overflowed);
+                // the late interrupt also covered the next tick
+                t++;
+            }
+            else {
+                tick(&config, t, 0, false, false);
+            }
+            errors += check_blocks(&config, blocks, lost, held);
+        }
+        overruns = channels_overruns() - overruns;
+        channels_stop();
+
+        for (t = 0; t < test->nchannels; t++) {
+            if (blocks[t] != ticks / test->divisors[t] / CHANNELS_BLOCK) {
+                printf("  channel %u: %u blocks, want %u\n", (unsigned)t,
+                       (unsigned)blocks[t],
+                       (unsigned)(ticks / test->divisors[t] / CHANNELS_BLOCK));
+                errors++;
+            }
+        }
+        if (overruns != (test->lost != ~0u)) {
+            printf("  %u overruns, want %u\n", (unsigned)overruns,
+                   (unsigned)(test->lost != ~0u));
+            errors++;
+        }
+
+        printf("%-32s %s\n", test->name, errors ? "FAIL" : "ok");
+        failures += errors ? 1 : 0;
+    }
+
+    return failures ? 1 : 0;
+}
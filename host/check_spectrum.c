@@ -0,0 +1,149 @@
+/*
+ * check_spectrum.c - Check the device's spectrum code against a reference.
+ *
+ * Usage: check_spectrum
+ *
+ * Builds src/spectrum.c for the host and feeds it test signals in uneven
+ * chunks, then compares every bin with a direct double-precision DFT of the
+ * same overlapping Hann windows, averaged and scaled the same way. Also
+ * checks that a sine centred on a bin reads its amplitude there.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "spectrum.h"
+
+#define CHECK_WINDOWS 40
+#define CHECK_SAMPLES (SPECTRUM_N / 2 * (CHECK_WINDOWS + 1))
+#define CHECK_TOLERANCE 1e-4
+
+typedef struct {
+    const char *name;
+    double amplitude;       // sine amplitude, or noise level if freq < 0
+    double freq;            // in bins
+    double offset;          // DC offset
+} signal_t;
+
+static const signal_t signals[] = {
+    { "sine on bin 10", 1.0, 10.0, 0.0 },
+    { "sine at bin 33.4", 0.5, 33.4, 0.0 },
+    { "sine near nyquist", 2.0, 127.0, 0.0 },
+    { "dc", 0.0, 0.0, 1.5 },
+    { "noise", 1.0, -1.0, 0.0 },
+    { "sine plus noise", 1.0, 50.0, 0.25 },
+};
+
+static const unsigned averages[] = { 1, 3, 8 };
+
+static void generate(const signal_t *sig, float *x, size_t n) {
+    size_t i;
+
+    srand(1);
+    for (i = 0; i < n; i++) {
+        double noise = (double)rand() / RAND_MAX - 0.5;
+        double v = sig->offset;
+
+        if (sig->freq < 0) {
+            v += sig->amplitude * noise;
+        }
+        else {
+            v += sig->amplitude * sin(2 * M_PI * sig->freq * i / SPECTRUM_N);
+            if (sig->offset != 0.0 && sig->freq > 0) {
+                v += 0.1 * noise;
+            }
+        }
+        x[i] = (float)v;
+    }
+}
+
+// Direct DFT of the averaged spectrum starting at window `first`.
+static void reference(const float *x, unsigned first, unsigned navg,
+                      double *bins) {
+    unsigned w, n, k;
+
+    for (k = 0; k < SPECTRUM_BINS; k++) {
+        double power = 0;
+
+        for (w = first; w < first + navg; w++) {
+            const float *win = x + w * SPECTRUM_N / 2;
+            double re = 0, im = 0;
+
+            for (n = 0; n < SPECTRUM_N; n++) {
+                double h = 0.5 - 0.5 * cos(2 * M_PI * n / SPECTRUM_N);
+                double a = 2 * M_PI * k * n / SPECTRUM_N;
+                re += win[n] * h * cos(a);
+                im -= win[n] * h * sin(a);
+            }
+            power += re * re + im * im;
+        }
+
+        bins[k] = sqrt(power / navg) * ((k == 0 || k == SPECTRUM_N / 2) ? 1 : 2)
+                  / (SPECTRUM_N / 2);
+    }
+}
+
+int main(void) {
+    static float x[CHECK_SAMPLES];
+    float bins[SPECTRUM_BINS];
+    double ref[SPECTRUM_BINS];
+    unsigned s, a, k;
+    int failed = 0;
+
+    spectrum_init();
+
+    for (s = 0; s < sizeof(signals) / sizeof(signals[0]); s++) {
+        generate(&signals[s], x, CHECK_SAMPLES);
+
+        for (a = 0; a < sizeof(averages) / sizeof(averages[0]); a++) {
+            unsigned navg = averages[a];
+            unsigned spectra = 0;
+            unsigned windows = 0;
+            double err = 0, peak = 0;
+            size_t pos = 0, chunk = 1;
+
+            spectrum_config(navg);
+
+            // Uneven chunks exercise the buffering across window edges.
+            while (pos < CHECK_SAMPLES) {
+                size_t n = (pos + chunk > CHECK_SAMPLES) ?
+                    CHECK_SAMPLES - pos : chunk;
+
+                windows += spectrum_add(x + pos, n);
+                pos += n;
+                chunk = chunk * 7 % 97 + 1;
+
+                if (spectrum_read(bins) == SPECTRUM_BINS) {
+                    reference(x, spectra * navg, navg, ref);
+                    for (k = 0; k < SPECTRUM_BINS; k++) {
+                        double d = fabs(bins[k] - ref[k]);
+                        err = (d > err) ? d : err;
+                        peak = (ref[k] > peak) ? ref[k] : peak;
+                    }
+                    if (signals[s].freq == 10.0 &&
+                            fabs(bins[10] - signals[s].amplitude) > 1e-4) {
+                        printf("  %s: bin 10 reads %g\n", signals[s].name,
+                               bins[10]);
+                        failed = 1;
+                    }
+                    spectra++;
+                }
+            }
+
+            printf("%-18s avg %u: %2u spectra from %2u windows, "
+                   "max error %.2e of peak %.3f\n",
+                   signals[s].name, navg, spectra, windows, err, peak);
+
+            if (windows != CHECK_WINDOWS || spectra != CHECK_WINDOWS / navg ||
+                    err > CHECK_TOLERANCE * peak + 1e-6) {
+                printf("  FAILED\n");
+                failed = 1;
+            }
+        }
+    }
+
+    printf(failed ? "FAILED\n" : "all spectra match\n");
+    return failed;
+}
@@ -0,0 +1,326 @@
+/*
+ * decode.c - Scalar, SSE2 and AVX2 sample decode kernels.
+ *
+ * Decoding happens in blocks. Each block of interleaved samples is first
+ * converted to calibrated floats in a small scratch buffer that stays in L1,
+ * then scattered out to the per-channel buffers. The conversion step is the
+ * one with SIMD variants. To let it apply per-channel calibration with plain
+ * vector loads, gain and offset are expanded into patterns of 8 * nchan
+ * values; blocks always start on a pattern boundary, so the pattern index of
+ * every vector is a multiple of the vector width and never straddles the end
+ * of the pattern.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "decode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECODE_X86
+#include <immintrin.h>
+#endif
+
+// Samples converted per block. Must hold at least 8 * DECODE_MAX_CHANNELS.
+#define DECODE_BLOCK 1024
+
+typedef void (*convert_fn)(const uint8_t *src, size_t n, const float *gpat,
+                           const float *opat, size_t plen, float *out);
+
+typedef struct {
+    const char *name;
+    convert_fn convert[DECODE_FORMATS];  // indexed by decode_format_t
+} decode_impl_ops_t;
+
+//*****************************************************************************
+// Scalar reference.
+//*****************************************************************************
+static inline uint32_t raw_u12(const uint8_t *src, size_t i) {
+    const uint8_t *p = src + (i >> 1) * 3;
+
+    if (i & 1) {
+        return (p[1] >> 4) | ((uint32_t)p[2] << 4);
+    }
+    return p[0] | ((uint32_t)(p[1] & 0x0f) << 8);
+}
+
+static inline uint32_t raw_u16(const uint8_t *src, size_t i) {
+    return src[2 * i] | ((uint32_t)src[2 * i + 1] << 8);
+}
+
+static inline int32_t raw_s16(const uint8_t *src, size_t i) {
+    return (int16_t)raw_u16(src, i);
+}
+
+// Each format gets a kernel that starts at an arbitrary pattern entry `k`,
+// used to finish off the SIMD kernels, and the plain convert_fn starting at
+// entry 0.
+#define SCALAR_CONVERT(fmt, raw)                                             \
+static void scalar_##fmt##_at(const uint8_t *src, size_t n,                 \
+                              const float *gpat, const float *opat,          \
+                              size_t plen, size_t k, float *out) {           \
+    size_t i;                                                                \
+    for (i = 0; i < n; i++) {                                                \
+        out[i] = (float)raw(src, i) * gpat[k] + opat[k];                     \
+        k = (k + 1 == plen) ? 0 : k + 1;                                     \
+    }                                                                        \
+}                                                                            \
+static void scalar_##fmt(const uint8_t *src, size_t n, const float *gpat,   \
+                         const float *opat, size_t plen, float *out) {       \
+    scalar_##fmt##_at(src, n, gpat, opat, plen, 0, out);                     \
+}
+
+SCALAR_CONVERT(u12, raw_u12)
+SCALAR_CONVERT(u16, raw_u16)
+SCALAR_CONVERT(s16, raw_s16)
+
+static const decode_impl_ops_t impl_scalar = {
+    "scalar", { scalar_u12, scalar_u16, scalar_s16 },
+};
+
+// Finish off the samples after `i` that a SIMD kernel left over. `i` is a
+// multiple of the vector width, so it is even and packed formats start on a
+// whole byte.
+#define SCALAR_TAIL(fmt, bytes_per_2)                                        \
+    scalar_##fmt##_at(src + (i / 2) * (bytes_per_2), n - i, gpat, opat,      \
+                      plen, i % plen, out + i)
+
+#ifdef DECODE_X86
+//*****************************************************************************
+// SSE2: four samples per step.
+//*****************************************************************************
+__attribute__((target("sse2")))
+static inline void sse2_store(__m128i v, const float *gpat, const float *opat,
+                              size_t k, float *out) {
+    __m128 f = _mm_cvtepi32_ps(v);
+    f = _mm_add_ps(_mm_mul_ps(f, _mm_loadu_ps(gpat + k)),
+                   _mm_loadu_ps(opat + k));
+    _mm_storeu_ps(out, f);
+}
+
+// Four packed 12-bit samples are a 48-bit little-endian bit string, so they
+// can be pulled out of one 64-bit load with shifts. The load reads two bytes
+// past the samples, hence the margin on the loop bound.
+__attribute__((target("sse2")))
+static void sse2_u12(const uint8_t *src, size_t n, const float *gpat,
+                     const float *opat, size_t plen, float *out) {
+    size_t i = 0, k = 0;
+    uint64_t x;
+
+    for (; i + 8 <= n; i += 4) {
+        memcpy(&x, src + (i / 2) * 3, sizeof(x));
+        sse2_store(_mm_set_epi32((int)((x >> 36) & 0xfff),
+                                 (int)((x >> 24) & 0xfff),
+                                 (int)((x >> 12) & 0xfff),
+                                 (int)(x & 0xfff)),
+                   gpat, opat, k, out + i);
+        k = (k + 4 == plen) ? 0 : k + 4;
+    }
+    SCALAR_TAIL(u12, 3);
+}
+
+__attribute__((target("sse2")))
+static void sse2_u16(const uint8_t *src, size_t n, const float *gpat,
+                     const float *opat, size_t plen, float *out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0, k = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        sse2_store(_mm_unpacklo_epi16(v, zero), gpat, opat, k, out + i);
+        sse2_store(_mm_unpackhi_epi16(v, zero), gpat, opat, k + 4, out + i + 4);
+        k = (k + 8 == plen) ? 0 : k + 8;
+    }
+    SCALAR_TAIL(u16, 4);
+}
+
+__attribute__((target("sse2")))
+static void sse2_s16(const uint8_t *src, size_t n, const float *gpat,
+                     const float *opat, size_t plen, float *out) {
+    size_t i = 0, k = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        // Put each sample in the top half of a 32-bit lane, then shift it
+        // down arithmetically to sign-extend.
+        sse2_store(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16),
+                   gpat, opat, k, out + i);
+        sse2_store(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16),
+                   gpat, opat, k + 4, out + i + 4);
+        k = (k + 8 == plen) ? 0 : k + 8;
+    }
+    SCALAR_TAIL(s16, 4);
+}
+
+static const decode_impl_ops_t impl_sse2 = {
+    "sse2", { sse2_u12, sse2_u16, sse2_s16 },
+};
+
+//*****************************************************************************
+// AVX2: eight samples per step.
+//*****************************************************************************
+__attribute__((target("avx2")))
+static inline void avx2_store(__m256i v, const float *gpat, const float *opat,
+                              size_t k, float *out) {
+    __m256 f = _mm256_cvtepi32_ps(v);
+    f = _mm256_add_ps(_mm256_mul_ps(f, _mm256_loadu_ps(gpat + k)),
+                      _mm256_loadu_ps(opat + k));
+    _mm256_storeu_ps(out, f);
+}
+
+// Eight packed samples take 12 bytes. A byte shuffle copies the two bytes
+// holding each sample into its own 16-bit lane; even samples then need the
+// top nibble masked off and odd samples need shifting down by four. The
+// 16-byte load reads four bytes past the samples, hence the loop margin.
+__attribute__((target("avx2")))
+static void avx2_u12(const uint8_t *src, size_t n, const float *gpat,
+                     const float *opat, size_t plen, float *out) {
+    const __m128i shuf = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+                                       6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i mask = _mm_set1_epi16(0x0fff);
+    size_t i = 0, k = 0;
+
+    for (; i + 16 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + (i / 2) * 3));
+        v = _mm_shuffle_epi8(v, shuf);
+        v = _mm_blend_epi16(_mm_and_si128(v, mask), _mm_srli_epi16(v, 4), 0xaa);
+        avx2_store(_mm256_cvtepu16_epi32(v), gpat, opat, k, out + i);
+        k = (k + 8 == plen) ? 0 : k + 8;
+    }
+    SCALAR_TAIL(u12, 3);
+}
+
+__attribute__((target("avx2")))
+static void avx2_u16(const uint8_t *src, size_t n, const float *gpat,
+                     const float *opat, size_t plen, float *out) {
+    size_t i = 0, k = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        avx2_store(_mm256_cvtepu16_epi32(v), gpat, opat, k, out + i);
+        k = (k + 8 == plen) ? 0 : k + 8;
+    }
+    SCALAR_TAIL(u16, 4);
+}
+
+__attribute__((target("avx2")))
+static void avx2_s16(const uint8_t *src, size_t n, const float *gpat,
+                     const float *opat, size_t plen, float *out) {
+    size_t i = 0, k = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        avx2_store(_mm256_cvtepi16_epi32(v), gpat, opat, k, out + i);
+        k = (k + 8 == plen) ? 0 : k + 8;
+    }
+    SCALAR_TAIL(s16, 4);
+}
+
+static const decode_impl_ops_t impl_avx2 = {
+    "avx2", { avx2_u12, avx2_u16, avx2_s16 },
+};
+#endif
+
+//*****************************************************************************
+// Dispatch.
+//*****************************************************************************
+static const decode_impl_ops_t *g_impl = NULL;
+
+int decode_select(decode_impl_t impl) {
+#ifdef DECODE_X86
+    __builtin_cpu_init();
+
+    if (impl == DECODE_IMPL_AUTO) {
+        impl = __builtin_cpu_supports("avx2") ? DECODE_IMPL_AVX2 :
+               __builtin_cpu_supports("sse2") ? DECODE_IMPL_SSE2 :
+               DECODE_IMPL_SCALAR;
+    }
+
+    switch (impl) {
+        case DECODE_IMPL_AVX2:
+            if (!__builtin_cpu_supports("avx2")) {
+                return -1;
+            }
+            g_impl = &impl_avx2;
+            return 0;
+
+        case DECODE_IMPL_SSE2:
+            if (!__builtin_cpu_supports("sse2")) {
+                return -1;
+            }
+            g_impl = &impl_sse2;
+            return 0;
+
+        default:
+            break;
+    }
+#else
+    if ((impl != DECODE_IMPL_AUTO) && (impl != DECODE_IMPL_SCALAR)) {
+        return -1;
+    }
+#endif
+
+    g_impl = &impl_scalar;
+    return 0;
+}
+
+const char *decode_impl_name(void) {
+    if (g_impl == NULL) {
+        decode_select(DECODE_IMPL_AUTO);
+    }
+    return g_impl->name;
+}
+
+int decode(decode_format_t fmt, const void *src, size_t nsamples,
+           unsigned nchan, const float *gain, const float *offset,
+           float *const *dst) {
+    const uint8_t *raw = (const uint8_t*)src;
+    float gpat[8 * DECODE_MAX_CHANNELS];
+    float opat[8 * DECODE_MAX_CHANNELS];
+    float block[DECODE_BLOCK];
+    size_t plen, block_frames, start, frame, n, f;
+    unsigned ch;
+    convert_fn convert;
+
+    if (((unsigned)fmt >= DECODE_FORMATS) || (nchan == 0) ||
+            (nchan > DECODE_MAX_CHANNELS)) {
+        return -1;
+    }
+    if (g_impl == NULL) {
+        decode_select(DECODE_IMPL_AUTO);
+    }
+    convert = g_impl->convert[fmt];
+
+    plen = 8 * (size_t)nchan;
+    for (f = 0; f < plen; f++) {
+        gpat[f] = gain[f % nchan];
+        opat[f] = offset[f % nchan];
+    }
+
+    // A single channel needs no scatter step.
+    if (nchan == 1) {
+        convert(raw, nsamples, gpat, opat, plen, dst[0]);
+        return 0;
+    }
+
+    // Whole pattern lengths per block, so every block starts at pattern
+    // entry 0 and on channel 0.
+    block_frames = (DECODE_BLOCK / plen) * 8;
+
+    for (start = 0, frame = 0; start < nsamples; start += n, frame += n / nchan) {
+        n = block_frames * nchan;
+        n = (nsamples - start < n) ? nsamples - start : n;
+
+        convert(raw + ((fmt == DECODE_U12) ? start / 2 * 3 : start * 2), n,
+                gpat, opat, plen, block);
+
+        for (ch = 0; ch < nchan; ch++) {
+            float *out = dst[ch] + frame;
+            for (f = 0; f < n / nchan; f++) {
+                out[f] = block[f * nchan + ch];
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * decode.h - Convert raw device samples to calibrated floats on the host.
+ *
+ * Raw samples arrive interleaved (ch0, ch1, ..., chN-1, ch0, ...) in one of
+ * the formats below. decode() unpacks them, applies a per-channel gain and
+ * offset (value = raw * gain + offset) and writes one float buffer per
+ * channel.
+ *
+ * There are scalar, SSE2 and AVX2 implementations. The fastest one the CPU
+ * supports is picked on first use; decode_select() overrides the choice for
+ * benchmarking and testing. All implementations give bit-identical results.
+ */
+
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Upper limit on channels, set by the size of decode()'s scratch buffers. */
+#define DECODE_MAX_CHANNELS 128
+
+typedef enum {
+    DECODE_U12,     // unsigned 12-bit, two samples packed little-endian in
+                    // three bytes
+    DECODE_U16,     // unsigned 16-bit little-endian
+    DECODE_S16,     // signed 16-bit little-endian
+    DECODE_FORMATS, // number of formats
+} decode_format_t;
+
+typedef enum {
+    DECODE_IMPL_AUTO,
+    DECODE_IMPL_SCALAR,
+    DECODE_IMPL_SSE2,
+    DECODE_IMPL_AVX2,
+} decode_impl_t;
+
+/*
+ * Choose the implementation used by decode(). Returns 0 on success or -1 if
+ * the CPU doesn't support it, in which case the current choice is kept.
+ */
+int decode_select(decode_impl_t impl);
+
+/* Name of the implementation currently in use. */
+const char *decode_impl_name(void);
+
+/*
+ * Decode `nsamples` interleaved samples of `nchan` channels from `src`.
+ * `nsamples` must be a multiple of `nchan` (and even for DECODE_U12).
+ * `gain` and `offset` hold one value per channel and dst[ch] must have room
+ * for nsamples / nchan floats. Returns 0 on success or -1, decoding
+ * nothing, if `fmt` isn't one of the formats above or `nchan` is 0 or more
+ * than DECODE_MAX_CHANNELS.
+ */
+int decode(decode_format_t fmt, const void *src, size_t nsamples,
+           unsigned nchan, const float *gain, const float *offset,
+           float *const *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+//*****************************************************************************
+// channels.h - Multi-rate analog acquisition on ADC0, see CMD_SET_CHANNELS.
+//
+// Timer 0A triggers sample sequencer 0 once per base period. The channels
+// due at each base tick over one hyperperiod (the least common multiple of
+// the divisors) are worked out when the channels are configured, down to the
+// sequencer's multiplexer and control register values, so the sequencer
+// interrupt only has to read the results and load the next tick's pair of
+// words. A tick with no channel due converts the temperature sensor instead
+// and throws the result away, so that every tick still ends in an interrupt.
+//
+// Each channel fills its own pair of buffers. Each time one fills, the event
+// given to channels_init() is signalled, and channels_read() must take the
+// block before the channel's other buffer fills too, or it is lost.
+//*****************************************************************************
+
+#ifndef _CHANNELS_H_
+#define _CHANNELS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+
+// largest payload channels_read() produces
+#define CHANNELS_PAYLOAD_MAX (sizeof(samples_header_t) + CHANNELS_BLOCK * sizeof(uint16_t))
+
+extern void channels_init(uint32_t event);
+extern bool channels_config(const channels_cmd_t *config, uint32_t period);
+extern void channels_start(void);
+extern void channels_stop(void);
+extern uint32_t channels_read(uint8_t *payload, uint32_t *timestamp);
+extern uint32_t channels_dropped(void);
+extern uint32_t channels_overruns(void);
+
+#endif
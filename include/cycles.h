@@ -0,0 +1,43 @@
+//*****************************************************************************
+// cycles.h - Free-running system clock cycle counter.
+//
+// Timer 5 runs as a single 32-bit timer counting up at the system clock rate.
+// It is used for frame timestamps and for measuring how long things take. At
+// 50 MHz it wraps every 86 seconds, so differences are only meaningful over
+// shorter spans than that (unsigned subtraction handles a single wrap).
+//
+// The DWT cycle counter would be cheaper to set up, but it stops whenever the
+// core sleeps in WFI, while peripheral clocks keep running in sleep mode.
+//
+// cycles_init() is called first thing in the reset handler, so the count
+// starts at reset. It only touches registers, since the C runtime isn't set up
+// by then. Until main() switches to the PLL the count runs at the 16 MHz
+// internal oscillator rather than the system clock.
+//*****************************************************************************
+
+#ifndef _CYCLES_H_
+#define _CYCLES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "inc/hw_memmap.h"
+#include "inc/hw_sysctl.h"
+#include "inc/hw_timer.h"
+#include "inc/hw_types.h"
+
+static inline void cycles_init(void) {
+    HWREG(SYSCTL_RCGCTIMER) |= SYSCTL_RCGCTIMER_R5;
+    while (!(HWREG(SYSCTL_PRTIMER) & SYSCTL_PRTIMER_R5)) {}
+
+    HWREG(TIMER5_BASE + TIMER_O_CFG) = TIMER_CFG_32_BIT_TIMER;
+    HWREG(TIMER5_BASE + TIMER_O_TAMR) = TIMER_TAMR_TAMR_PERIOD |
+                                        TIMER_TAMR_TACDIR;
+    HWREG(TIMER5_BASE + TIMER_O_TAILR) = 0xFFFFFFFF;
+    HWREG(TIMER5_BASE + TIMER_O_CTL) |= TIMER_CTL_TAEN;
+}
+
+static inline uint32_t cycles_now(void) {
+    return HWREG(TIMER5_BASE + TIMER_O_TAV);
+}
+
+#endif
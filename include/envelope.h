@@ -0,0 +1,35 @@
+//*****************************************************************************
+// envelope.h - Per-window statistics of the analog channels, see
+// CMD_SET_FEATURES.
+//
+// Each sample block is folded into its channel's running sums as it arrives,
+// with the per-sample work kept to a few integer operations; the mean and
+// RMS are only worked out in floating point when a window closes. A sample
+// equal to the level counts as being on the same side as the one before it,
+// so a crossing is only counted once the signal is past the level.
+//
+// Windows are at least a block long, so each block closes at most one window
+// and fills at most one block of decimated samples. envelope_read() and
+// envelope_read_samples() must be called after each envelope_add() to take
+// them, or they are overwritten.
+//
+// This is plain C with no hardware access, like spectrum.c.
+//*****************************************************************************
+
+#ifndef _ENVELOPE_H_
+#define _ENVELOPE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+
+// largest payload envelope_read_samples() produces
+#define ENVELOPE_PAYLOAD_MAX (sizeof(samples_header_t) + CHANNELS_BLOCK * sizeof(uint16_t))
+
+extern void envelope_config(uint32_t window, uint16_t level, uint16_t decimation);
+extern void envelope_add(const samples_header_t *header, uint32_t timestamp);
+extern bool envelope_read(features_t *features, uint32_t *timestamp);
+extern uint32_t envelope_read_samples(uint8_t *payload, uint32_t *timestamp);
+
+#endif
@@ -0,0 +1,30 @@
+//*****************************************************************************
+// logic.h - Logic-analyzer capture of GPIO port B, see CMD_SET_LOGIC.
+//
+// Timer 1A paces a uDMA channel that copies the port B data register into a
+// pair of SRAM buffers in ping-pong mode. Each time a buffer fills, the DMA
+// completion interrupt signals the event given to logic_init(), and
+// logic_read() then encodes the block into a FRAME_LOGIC payload while the
+// other buffer fills. A block must be read within one block time of
+// completing, or it is lost.
+//
+// The uDMA controller itself must already be enabled.
+//*****************************************************************************
+
+#ifndef _LOGIC_H_
+#define _LOGIC_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+// largest payload logic_read() produces
+#define LOGIC_PAYLOAD_MAX (sizeof(logic_header_t) + LOGIC_BLOCK)
+
+extern void logic_init(uint32_t event);
+extern void logic_start(uint32_t period, uint8_t mask);
+extern void logic_stop(void);
+extern uint32_t logic_read(uint8_t *payload, uint32_t *timestamp);
+extern uint32_t logic_dropped(void);
+
+#endif
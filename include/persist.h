@@ -0,0 +1,33 @@
+//*****************************************************************************
+// persist.h - Acquisition settings kept in the on-chip EEPROM across resets.
+//
+// The last command of each kind that sets up acquisition or the stream
+// (channels, spectrum, features, logic analyzer, SPI, coalescing and
+// telemetry) is stored as it was received, along with whether sampling was
+// on. After a reset they can be replayed through the normal command
+// handler, so the device picks up where it left off without the host
+// sending anything.
+//
+// Each kind of command has its own slot, and a slot is only written when
+// its contents change, which keeps EEPROM wear down to one write per real
+// change of settings. Writes busy-wait until the EEPROM has finished, which
+// can take milliseconds, so they must not be made from an interrupt handler.
+//*****************************************************************************
+
+#ifndef _PERSIST_H_
+#define _PERSIST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+
+typedef void (*persist_handler_t)(uint8_t *cmd);
+
+extern void persist_init(void);
+extern void persist_save(const uint8_t *cmd);
+extern void persist_streaming(bool streaming);
+extern bool persist_replay(persist_handler_t handler);
+extern void persist_clear(void);
+
+#endif
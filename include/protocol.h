@@ -0,0 +1,419 @@
+//*****************************************************************************
+// protocol.h - Commands and replies exchanged with the host over the bulk
+// endpoints.
+//
+// The host sends a command as a single bulk OUT packet whose first byte is
+// one of the CMD_* opcodes below, followed by any command-specific payload.
+// Opcodes are kept below the printable ASCII range so plain text written by
+// the interactive test script still falls through to the legacy behavior of
+// toggling the sample timer.
+//
+// Everything the device sends is a frame: a frame_header_t followed by
+// `length` bytes of payload whose layout depends on the frame type. Replies
+// to commands are FRAME_REPLY frames whose payload starts with the opcode of
+// the command they answer.
+//
+// All multi-byte fields are little-endian. The host-side mirror of these
+// definitions lives in tivadaq.py and must be kept in sync.
+//*****************************************************************************
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdint.h>
+
+// Largest command packet, in bytes. Anything beyond this is ignored.
+#define COMMAND_MAX_SIZE 64
+
+//*****************************************************************************
+// Frames sent to the host.
+//*****************************************************************************
+#define FRAME_SAMPLES   0x00    // analog samples, see CMD_SET_CHANNELS
+#define FRAME_REPLY     0x01    // reply to a command
+#define FRAME_TELEMETRY 0x02    // telemetry_t, see CMD_SET_TELEMETRY
+#define FRAME_LOGIC     0x03    // logic-analyzer block, see CMD_SET_LOGIC
+#define FRAME_SPI       0x04    // SPI sensor readings, see CMD_SET_SPI
+#define FRAME_SPECTRUM  0x05    // averaged spectrum, see CMD_SET_SPECTRUM
+#define FRAME_FEATURES  0x06    // window statistics, see CMD_SET_FEATURES
+#define FRAME_TYPE_COUNT 7
+
+typedef struct {
+    uint8_t type;         // FRAME_*
+    uint8_t seq;          // counts frames of this type, including dropped ones
+    uint16_t length;      // payload bytes following the header
+    uint32_t timestamp;   // cycle counter (see cycles.h) when the first
+                          // sample was taken, or for frames without samples,
+                          // when the frame was sent
+} __attribute__((packed)) frame_header_t;
+
+//*****************************************************************************
+// Report stack usage. The reply payload is a stack_reply_t.
+//*****************************************************************************
+#define CMD_GET_STACK 0x01
+
+typedef struct {
+    uint8_t cmd;          // CMD_GET_STACK
+    uint8_t reserved[3];
+    uint32_t size;        // size of the system stack in bytes
+    uint32_t high_water;  // deepest stack usage seen since reset in bytes
+} __attribute__((packed)) stack_reply_t;
+
+//*****************************************************************************
+// Closed-loop round trip: set the PWM output on PE4, then sample AIN0 (PE3)
+// and send the result straight back. Both sides use a 12-bit scale. The reply
+// payload is a loop_reply_t and echoes the sequence number so the host can
+// match it to its request.
+//*****************************************************************************
+#define CMD_LOOP 0x02
+
+#define LOOP_OUTPUT_MAX 4095
+
+typedef struct {
+    uint8_t cmd;          // CMD_LOOP
+    uint8_t seq;          // echoed back in the reply
+    uint16_t output;      // PWM duty in counts, 0 to LOOP_OUTPUT_MAX
+} __attribute__((packed)) loop_cmd_t;
+
+typedef struct {
+    uint8_t cmd;          // CMD_LOOP
+    uint8_t seq;          // from the matching loop_cmd_t
+    uint16_t sample;      // AIN0 conversion result
+} __attribute__((packed)) loop_reply_t;
+
+//*****************************************************************************
+// Enable (payload byte 1 non-zero) or disable low-latency mode. While it is
+// enabled, streaming is stopped and debug output is skipped on the USB path
+// so that CMD_LOOP replies go out as soon as they are written. There is no
+// reply.
+//*****************************************************************************
+#define CMD_SET_LOW_LATENCY 0x03
+
+//*****************************************************************************
+// Set the transmit coalescing policy. Data is held back until `packets` full
+// packets are waiting or the oldest byte has been held for `hold_ms`
+// milliseconds, whichever comes first. A `packets` of 0 sends everything
+// right away (the default) and a `hold_ms` of 0 means no time limit.
+//
+// With COALESCE_ZLP set, a zero-length packet is sent whenever the buffer
+// drains right after a full-sized packet, so a host reading in large blocks
+// sees the end of each transfer. Leave it clear when reading one packet at a
+// time, as each zero-length packet shows up as an empty read. There is no
+// reply.
+//*****************************************************************************
+#define CMD_SET_COALESCE 0x04
+
+#define COALESCE_MAX_PACKETS 8
+#define COALESCE_ZLP 0x01
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_COALESCE
+    uint8_t packets;      // full packets to wait for, up to COALESCE_MAX_PACKETS
+    uint16_t hold_ms;     // maximum hold time in milliseconds
+    uint8_t flags;        // COALESCE_*
+} __attribute__((packed)) coalesce_cmd_t;
+
+//*****************************************************************************
+// Send a FRAME_TELEMETRY frame every `interval_ms` milliseconds, or never if
+// it is 0 (the default). Counters are totals since reset; fill levels, idle
+// time and overruns cover the time since the previous telemetry frame. There
+// is no reply.
+//*****************************************************************************
+#define CMD_SET_TELEMETRY 0x05
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_TELEMETRY
+    uint16_t interval_ms;
+} __attribute__((packed)) telemetry_cmd_t;
+
+typedef struct {
+    uint32_t tx_bytes;          // bytes delivered to the host
+    uint32_t rx_bytes;          // bytes received from the host
+    uint32_t dropped_frames;    // frames that didn't fit in the transmit buffer
+    uint32_t dropped_samples;   // samples lost with them, or for lack of
+                                // credit
+    uint16_t tx_fill_min;       // transmit buffer fill level in bytes
+    uint16_t tx_fill_max;
+    uint16_t timer_overruns;    // sample ticks that arrived before the last
+                                // one had been handled, see CMD_SET_CHANNELS
+    uint16_t idle_permille;     // time asleep in WFI, in tenths of a percent
+    uint32_t stack_high_water;  // see CMD_GET_STACK
+    uint32_t latency_max;       // longest wait from an event to its task
+                                // starting, in cycles
+    uint32_t fft_cycles;        // most cycles taken by one spectrum window,
+                                // see CMD_SET_SPECTRUM
+    uint32_t boot_cycles;       // cycles from reset to the first analog
+                                // sample, or 0 if there hasn't been one;
+                                // those before the PLL is up are at 16 MHz
+    uint32_t credits;           // credit left, see CMD_GRANT_CREDITS
+    uint32_t degraded_frames;   // sample frames sent averaged down for lack
+                                // of credit
+    uint32_t throttled_frames;  // frames not sent for lack of credit
+} __attribute__((packed)) telemetry_t;
+
+//*****************************************************************************
+// Logic-analyzer mode: sample the pins of GPIO port B selected by `mask` at
+// `rate_hz`, up to LOGIC_MAX_RATE, or stop if it is 0. Samples are taken by
+// the uDMA on a timer trigger, so the rate is exact and unaffected by
+// interrupts. There is no reply.
+//
+// Each block of LOGIC_BLOCK samples goes out as a FRAME_LOGIC frame: a
+// logic_header_t followed by the samples, with unselected pins reading 0.
+// LOGIC_RLE blocks hold runs as pairs of bytes, the pin values and then the
+// run length minus one. Blocks that wouldn't get smaller that way are sent
+// as LOGIC_RAW, one byte per sample. The frame timestamp is the time of the
+// first sample, on the same clock as the other streams, and sample i was
+// taken `period` cycles apart from there.
+//*****************************************************************************
+#define CMD_SET_LOGIC 0x06
+
+#define LOGIC_MAX_RATE 1000000
+#define LOGIC_BLOCK 256
+
+#define LOGIC_RAW 0x00
+#define LOGIC_RLE 0x01
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_LOGIC
+    uint8_t mask;         // port B pins to sample
+    uint32_t rate_hz;
+} __attribute__((packed)) logic_cmd_t;
+
+typedef struct {
+    uint8_t encoding;     // LOGIC_RAW or LOGIC_RLE
+    uint8_t mask;         // pins sampled
+    uint16_t nsamples;    // samples in the block
+    uint32_t period;      // cycles between samples
+    uint32_t block;       // counts blocks since the start, so lost blocks
+                          // show up as gaps
+} __attribute__((packed)) logic_header_t;
+
+//*****************************************************************************
+// SPI sensor acquisition on SSI0 (CLK PA2, FSS PA3, RX PA4, TX PA5): at
+// `rate_hz`, up to SPI_MAX_RATE, clock the `nbytes` bytes of `tx` out to the
+// sensor and keep the `nbytes` bytes clocked back in. A `rate_hz` of 0 stops.
+// The SPI clock, `bit_rate`, must be from SPI_MIN_BIT_RATE to
+// SPI_MAX_BIT_RATE, or the command is ignored. Typically `tx` is a register
+// address with the read bit set, padded with dummy bytes for the data to be
+// read. There is no reply.
+//
+// Each transaction is a single uDMA burst into the transmit FIFO, so
+// `nbytes` must be 1, 2, 4 or 8. In SPI modes 0 and 2 the SSI releases FSS
+// between bytes, so multi-byte register reads need mode 1 or 3.
+//
+// Every SPI_BLOCK transactions go out as a FRAME_SPI frame: an spi_header_t
+// followed by the received bytes of each transaction in turn. The frame
+// timestamp is the start of the first transaction, and transaction i starts
+// `period` cycles apart from there.
+//*****************************************************************************
+#define CMD_SET_SPI 0x07
+
+#define SPI_MAX_RATE 20000
+#define SPI_MIN_BIT_RATE 769          // system clock / (254 * 256), rounded up
+#define SPI_MAX_BIT_RATE 25000000     // system clock / 2
+#define SPI_MAX_XFER 8
+#define SPI_BLOCK 32
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_SPI
+    uint8_t nbytes;       // bytes per transaction, 1, 2, 4 or 8
+    uint8_t mode;         // SPI mode, 0 to 3
+    uint8_t reserved;
+    uint32_t bit_rate;    // SPI clock in Hz
+    uint32_t rate_hz;     // transactions per second
+    uint8_t tx[SPI_MAX_XFER];
+} __attribute__((packed)) spi_cmd_t;
+
+typedef struct {
+    uint8_t nbytes;       // bytes per transaction
+    uint8_t count;        // transactions in the frame
+    uint16_t reserved;
+    uint32_t period;      // cycles between transactions
+    uint32_t block;       // counts frames since the start, so lost ones show
+                          // up as gaps
+} __attribute__((packed)) spi_header_t;
+
+//*****************************************************************************
+// Spectral mode: compute magnitude spectra of analog channel 0 on the
+// device, in ADC counts, averaged over `averages` SPECTRUM_N-point windows
+// that overlap by half, or stop if it is 0. Unless SPECTRUM_RAW is set in
+// `flags`, channel 0's sample frames are no longer sent. There is no reply.
+//
+// Each averaged spectrum goes out as a FRAME_SPECTRUM frame: a
+// spectrum_header_t followed by SPECTRUM_BINS float magnitudes, from DC up
+// to half the sample rate. Bin k is at k / (SPECTRUM_N * period) times the
+// clock rate.
+//*****************************************************************************
+#define CMD_SET_SPECTRUM 0x08
+
+#define SPECTRUM_N 256
+#define SPECTRUM_BINS (SPECTRUM_N / 2 + 1)
+
+#define SPECTRUM_RAW 0x01
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_SPECTRUM
+    uint8_t flags;        // SPECTRUM_*
+    uint16_t averages;    // windows per spectrum
+} __attribute__((packed)) spectrum_cmd_t;
+
+typedef struct {
+    uint16_t nfft;        // SPECTRUM_N
+    uint16_t averages;    // windows in this spectrum
+    uint32_t period;      // cycles between samples
+} __attribute__((packed)) spectrum_header_t;
+
+//*****************************************************************************
+// Multi-rate analog acquisition on ADC0: sample up to CHANNELS_MAX analog
+// inputs, each at `base_hz` divided by its own `divisor`, so slow channels
+// don't cost ADC time or bandwidth at the rate of the fast ones. Sampling
+// runs while the sample timer is on, see CMD_SET_STREAMING. There is no
+// reply, and a configuration the device can't meet is ignored: the
+// divisors, once reduced by their common factor, must have a least common
+// multiple of at most CHANNELS_MAX_SLOTS, and `base_hz` must be at most
+// CHANNELS_MAX_RATE.
+//
+// Channel i's samples go out in blocks of CHANNELS_BLOCK as FRAME_SAMPLES
+// frames: a samples_header_t followed by the 12-bit conversion results as
+// uint16s. Each channel has its own timeline: the frame timestamp is the
+// time of the first sample, and sample j was taken `period` cycles apart
+// from there. The analog inputs AIN0 to AIN11 are on PE3, PE2, PE1, PE0,
+// PD3, PD2, PD1, PD0, PE5, PE4, PB4 and PB5. AIN9 is the closed-loop PWM
+// output and AIN10 and AIN11 are logic-analyzer pins, which lose those roles
+// while they are sampled.
+//
+// At reset AIN0 is sampled at 32 Hz.
+//*****************************************************************************
+#define CMD_SET_CHANNELS 0x09
+
+#define CHANNELS_MAX 8
+#define CHANNELS_MAX_AIN 11
+#define CHANNELS_MAX_RATE 100000
+#define CHANNELS_MAX_SLOTS 64
+#define CHANNELS_BLOCK 32
+
+typedef struct {
+    uint8_t ain;          // analog input, 0 to CHANNELS_MAX_AIN
+    uint8_t reserved;
+    uint16_t divisor;     // samples once every `divisor` base periods
+} __attribute__((packed)) channel_config_t;
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_CHANNELS
+    uint8_t nchannels;    // entries used in `channel`, 1 to CHANNELS_MAX
+    uint16_t reserved;
+    uint32_t base_hz;     // base trigger rate
+    channel_config_t channel[CHANNELS_MAX];
+} __attribute__((packed)) channels_cmd_t;
+
+typedef struct {
+    uint8_t channel;      // index into channels_cmd_t.channel
+    uint8_t ain;          // analog input sampled
+    uint16_t nsamples;    // samples in the block
+    uint32_t period;      // cycles between samples of this channel
+    uint32_t block;       // counts this channel's blocks since the start, so
+                          // lost blocks show up as gaps
+} __attribute__((packed)) samples_header_t;
+
+//*****************************************************************************
+// Forget the settings stored in EEPROM. The device keeps every setup command
+// it accepts that configures acquisition or the stream (CMD_SET_COALESCE,
+// CMD_SET_TELEMETRY, CMD_SET_CHANNELS, CMD_SET_SPECTRUM, CMD_SET_FEATURES,
+// CMD_SET_LOGIC and CMD_SET_SPI), and whether sampling is on, and replays
+// them as soon as the host has configured it after a reset. This stops that
+// until new settings are sent; the settings in effect are left alone. There
+// is no reply.
+//*****************************************************************************
+#define CMD_CLEAR_CONFIG 0x0A
+
+//*****************************************************************************
+// Feature mode: reduce every analog channel to statistics over consecutive
+// windows of `window` of its own samples, or stop if `window` is 0. It must
+// otherwise be at least FEATURES_MIN_WINDOW, or the command is ignored.
+// Peak, RMS and zero crossings are taken about `level`, in ADC counts, so
+// set it to the signal's resting level (2048 for a signal biased to the
+// middle of the range). It must be at most FEATURES_MAX_LEVEL, the top of
+// the ADC's range, or the command is ignored. There is no reply.
+//
+// Each window goes out as a FRAME_FEATURES frame holding a features_t,
+// stamped with the time of the window's first sample. A window never spans
+// blocks the device lost before it could take them; the next one starts
+// over after the gap.
+//
+// While feature mode is on, each channel's sample frames are replaced by
+// ones in which every sample is the mean of `decimation` consecutive samples,
+// with `period` scaled to match and their own block count. A `decimation` of
+// 1 keeps the samples as they are and 0 stops them altogether. Channel 0's
+// samples are still held back in spectral mode without SPECTRUM_RAW.
+//*****************************************************************************
+#define CMD_SET_FEATURES 0x0B
+
+#define FEATURES_MIN_WINDOW CHANNELS_BLOCK
+#define FEATURES_MAX_LEVEL 4095
+
+typedef struct {
+    uint8_t cmd;          // CMD_SET_FEATURES
+    uint8_t reserved;
+    uint16_t level;       // reference level in ADC counts
+    uint32_t window;      // samples per window
+    uint16_t decimation;  // samples averaged per sample sent, 0 for none
+} __attribute__((packed)) features_cmd_t;
+
+typedef struct {
+    uint8_t channel;      // index into channels_cmd_t.channel
+    uint8_t ain;          // analog input sampled
+    uint16_t min;         // smallest sample
+    uint16_t max;         // largest sample
+    uint16_t peak;        // largest distance of a sample from `level`
+    uint32_t crossings;   // times the signal crossed `level`
+    uint32_t window;      // samples in the window
+    uint32_t period;      // cycles between samples
+    uint32_t index;       // counts this channel's windows since the start,
+                          // so lost frames show up as gaps
+    float mean;           // mean sample
+    float rms;            // RMS distance of the samples from `level`
+} __attribute__((packed)) features_t;
+
+//*****************************************************************************
+// Credit-based flow control, off until the host first grants credit. While
+// it is on, every frame except replies and telemetry uses up credit equal to
+// its size, header included, and the host keeps the stream going by granting
+// more as it consumes it, for example as it writes it to disk. Each grant
+// with CREDITS_ON in `flags` adds `credits` bytes to the balance and sets
+// `low_water` and `decimation`; one without turns flow control off. There
+// is no reply, and grants are handled straight away in the USB interrupt.
+//
+// Instead of losing data at random when the host falls behind, the device
+// degrades on purpose. While the balance is below `low_water`, each sample
+// frame is averaged down by `decimation` before it is sent, so it holds
+// CHANNELS_BLOCK / `decimation` samples at `decimation` times the period,
+// with its block number unchanged. `decimation` must divide CHANNELS_BLOCK,
+// or the grant is ignored; 1 leaves the samples alone. Any frame the
+// balance can't cover is not sent at all, but uses up its sequence number
+// as a dropped frame would. Telemetry counts both cases apart from frames
+// dropped because the transmit buffer was full.
+//
+// Flow control is turned off whenever the host configures the device, so a
+// host that doesn't use it isn't left without credit.
+//*****************************************************************************
+#define CMD_GRANT_CREDITS 0x0C
+
+#define CREDITS_ON 0x01
+
+typedef struct {
+    uint8_t cmd;          // CMD_GRANT_CREDITS
+    uint8_t flags;        // CREDITS_*
+    uint16_t decimation;  // samples averaged per sample sent below low_water
+    uint32_t low_water;   // balance below which samples are averaged down
+    uint32_t credits;     // bytes added to the balance
+} __attribute__((packed)) credits_cmd_t;
+
+//*****************************************************************************
+// Start the sample timer if the byte after the opcode is nonzero, or stop it
+// if it is zero. Unlike the legacy toggle, this does nothing if the timer is
+// already in that state, so a host that doesn't know whether the device
+// resumed streaming after a reset (see CMD_CLEAR_CONFIG) can still start or
+// stop it safely. There is no reply.
+//*****************************************************************************
+#define CMD_SET_STREAMING 0x0D
+
+#endif
@@ -0,0 +1,28 @@
+//*****************************************************************************
+// sched.h - Event-driven cooperative task scheduler.
+//
+// Each task is tied to one event, identified by a number from 0 to
+// SCHED_MAX_TASKS - 1. Interrupt handlers signal events with sched_signal()
+// and sched_run() calls the task for each one from the main loop, always
+// picking the lowest-numbered pending event first, so task numbers double as
+// priorities. Tasks run to completion. With nothing pending, the core sleeps
+// in WFI until the next interrupt, and the time spent asleep is counted.
+//*****************************************************************************
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SCHED_MAX_TASKS 32
+
+typedef void (*sched_task_t)(void);
+
+extern void sched_task(uint32_t event, sched_task_t task);
+extern bool sched_signal(uint32_t event);
+extern void sched_run(void);
+extern uint32_t sched_idle_cycles(void);
+extern uint32_t sched_latency_max(void);
+
+#endif
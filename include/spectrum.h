@@ -0,0 +1,27 @@
+//*****************************************************************************
+// spectrum.h - Averaged magnitude spectra of the sample stream, see
+// CMD_SET_SPECTRUM.
+//
+// Samples are cut into SPECTRUM_N-point windows overlapping by half, each
+// weighted with a Hann window and transformed with a real FFT. The power in
+// each bin is averaged over a set number of windows and the square root
+// taken, giving the RMS-averaged magnitude as in Welch's method. Bins are
+// scaled so that a sine of amplitude A centred on a bin reads A there.
+//
+// This is plain C with no hardware access, so the host can build it too and
+// check it against a reference DFT (see host/check_spectrum.c).
+//*****************************************************************************
+
+#ifndef _SPECTRUM_H_
+#define _SPECTRUM_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+extern void spectrum_init(void);
+extern void spectrum_config(uint16_t averages);
+extern uint32_t spectrum_add(const float *samples, uint32_t nsamples);
+extern uint32_t spectrum_read(float *bins);
+
+#endif
@@ -0,0 +1,32 @@
+//*****************************************************************************
+// spi.h - Timer-triggered SPI sensor acquisition on SSI0, see CMD_SET_SPI.
+//
+// Timer 2A paces a uDMA channel that writes one transaction's bytes into the
+// SSI0 transmit FIFO per timeout, and a second channel drains the receive
+// FIFO into a pair of SRAM buffers in ping-pong mode. The CPU only sees one
+// interrupt per block of SPI_BLOCK transactions on each side. Each time a
+// receive buffer fills, the event given to spi_init() is signalled, and
+// spi_read() must take the block within one block time or it is lost.
+//
+// The uDMA controller itself must already be enabled.
+//*****************************************************************************
+
+#ifndef _SPI_H_
+#define _SPI_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+
+// largest payload spi_read() produces
+#define SPI_PAYLOAD_MAX (sizeof(spi_header_t) + SPI_BLOCK * SPI_MAX_XFER)
+
+extern void spi_init(uint32_t event);
+extern bool spi_valid(const spi_cmd_t *config);
+extern bool spi_start(const spi_cmd_t *config, uint32_t period);
+extern void spi_stop(void);
+extern uint32_t spi_read(uint8_t *payload, uint32_t *timestamp);
+extern uint32_t spi_dropped(void);
+
+#endif
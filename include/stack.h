@@ -0,0 +1,20 @@
+//*****************************************************************************
+// stack.h - Run-time stack usage, implemented in startup_gcc.c.
+//
+// The unused part of the system stack is painted with STACK_PAINT at reset.
+// The high-water mark is found by scanning up from the bottom of the stack
+// for the first word that no longer holds the pattern, so it only ever
+// reports usage that has actually happened since reset.
+//*****************************************************************************
+
+#ifndef _STACK_H_
+#define _STACK_H_
+
+#include <stdint.h>
+
+#define STACK_PAINT 0xDEADBEEF
+
+extern uint32_t StackSize(void);
+extern uint32_t StackHighWater(void);
+
+#endif
@@ -35,11 +35,17 @@
 #include "usblib/device/usbdbulk.h"
 
 //*****************************************************************************
-// The size of the transmit and receive buffers used. 256 is chosen pretty
-// much at random though the buffer should be at least twice the size of
-// a maximum-sized USB packet.
+// The size of the transmit and receive buffers used. The buffer should be at
+// least twice the size of a maximum-sized USB packet; 1024 leaves room for the
+// transmit coalescing policy to hold back several full packets while earlier
+// ones are still on their way out.
 //*****************************************************************************
-#define BULK_BUFFER_SIZE 256
+#define BULK_BUFFER_SIZE 1024
+
+//*****************************************************************************
+// Maximum packet size of the bulk endpoints at full speed.
+//*****************************************************************************
+#define BULK_PACKET_SIZE 64
 
 extern unsigned long RxHandler(void *data, uint32_t event, uint32_t msgval, void *msgdata);
 extern unsigned long TxHandler(void *data, uint32_t event, uint32_t msgval, void *msgdata);
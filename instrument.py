@@ -0,0 +1,339 @@
+"""Latency histograms, queue gauges and tracing for host-side pipelines.
+
+A pipeline names its stages and queues once and then records into them from
+whichever threads run it:
+
+    >>> inst = Instruments(trace_events=100000)
+    >>> decode = inst.stage('decode')
+    >>> t0 = time.perf_counter_ns()
+    >>> ...
+    >>> decode.record(t0, time.perf_counter_ns())
+
+Each thread records into its own histograms, so the hot path takes no locks;
+stats() and report() merge them when asked, and show each stage both since
+the start and since the previous call. Times are in nanoseconds on the
+perf_counter_ns() clock. With `trace_events`, the most recent spans and
+gauge changes are also kept for write_trace(), which writes them in the
+Chrome trace format for chrome://tracing or https://ui.perfetto.dev.
+
+DeviceClock puts frame timestamps on the same clock, so the latency from a
+sample being taken on the device to any point on the host can be recorded
+too.
+"""
+
+import collections
+import json
+import threading
+import time
+
+from tivadaq import CLOCK_HZ
+
+# Histograms are exact up to 2 * SUB_BUCKETS ns and keep 1 / SUB_BUCKETS
+# relative precision above that, as in HdrHistogram.
+SUB_BITS = 5
+SUB_BUCKETS = 1 << SUB_BITS
+
+# Longest latency told apart, 2**40 ns or about 18 minutes; anything longer
+# goes in the last bucket.
+MAX_BITS = 40
+NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS
+
+PERCENTILES = (50, 90, 99, 99.9)
+
+
+def bucket_index(value):
+    """Histogram bucket of a non-negative integer value."""
+    shift = value.bit_length() - SUB_BITS - 1
+    if shift <= 0:
+        return value
+    return min(shift * SUB_BUCKETS + (value >> shift), NUM_BUCKETS - 1)
+
+
+def bucket_value(index):
+    """Middle of the range of values in a histogram bucket."""
+    if index < 2 * SUB_BUCKETS:
+        return index
+    shift = index // SUB_BUCKETS - 1
+    top = index - shift * SUB_BUCKETS
+    return (top << shift) + (1 << shift) // 2
+
+
+class Histogram(object):
+    """Counts of values in log-spaced buckets, for one thread to record into.
+    """
+
+    def __init__(self):
+        self.counts = [0] * NUM_BUCKETS
+        self.total = 0
+        self.max = 0
+
+    def add(self, value):
+        value = max(int(value), 0)
+        self.counts[bucket_index(value)] += 1
+        self.total += value
+        if value > self.max:
+            self.max = value
+
+    def merge(self, other):
+        for i, n in enumerate(other.counts):
+            if n:
+                self.counts[i] += n
+        self.total += other.total
+        self.max = max(self.max, other.max)
+
+    def copy(self):
+        h = Histogram()
+        h.merge(self)
+        return h
+
+    def minus(self, earlier):
+        """Histogram of the values added since `earlier`, a copy of this one.
+
+        The maximum can't be taken apart, so it stays the overall one.
+        """
+        h = Histogram()
+        h.counts = [a - b for a, b in zip(self.counts, earlier.counts)]
+        h.total = self.total - earlier.total
+        h.max = self.max
+        return h
+
+    @property
+    def count(self):
+        return sum(self.counts)
+
+    def percentile(self, p):
+        """Value at or below which `p` percent of the values lie."""
+        count = self.count
+        if not count:
+            return 0
+        rank = max(1, int(round(count * p / 100.0)))
+        seen = 0
+        for i, n in enumerate(self.counts):
+            seen += n
+            if seen >= rank:
+                return min(bucket_value(i), self.max)
+        return self.max
+
+    def summary(self):
+        count = self.count
+        s = {'count': count, 'mean': self.total / count if count else 0,
+             'max': self.max}
+        for p in PERCENTILES:
+            s['p{}'.format(p)] = self.percentile(p)
+        return s
+
+
+class Stage(object):
+    """Latency of one pipeline stage, recorded from any number of threads."""
+
+    def __init__(self, instruments, name):
+        self.instruments = instruments
+        self.name = name
+        self.local = threading.local()
+        self.histograms = []
+        self.lock = threading.Lock()
+        self.last = Histogram()
+
+    def _histogram(self):
+        h = getattr(self.local, 'histogram', None)
+        if h is None:
+            h = self.local.histogram = Histogram()
+            # Only taken once per thread, to register its histogram.
+            with self.lock:
+                self.histograms.append(h)
+        return h
+
+    def add(self, latency):
+        """Record a latency in ns without tracing it."""
+        self._histogram().add(latency)
+
+    def record(self, start, end, **args):
+        """Record the time from `start` to `end`, and trace it as a span with
+        any keyword arguments attached."""
+        self._histogram().add(end - start)
+        self.instruments._span(self.name, start, end, args)
+
+    def merged(self):
+        h = Histogram()
+        with self.lock:
+            histograms = list(self.histograms)
+        for t in histograms:
+            h.merge(t)
+        return h
+
+
+class Gauge(object):
+    """A level such as a queue depth, with the highest it has been."""
+
+    def __init__(self, instruments, name):
+        self.instruments = instruments
+        self.name = name
+        self.value = 0
+        self.max = 0
+        self.interval_max = 0
+
+    def set(self, value):
+        self.value = value
+        if value > self.interval_max:
+            self.interval_max = value
+            if value > self.max:
+                self.max = value
+        self.instruments._counter(self.name, value)
+
+
+class Instruments(object):
+    """The stages and gauges of one pipeline."""
+
+    def __init__(self, trace_events=0):
+        self.origin = time.perf_counter_ns()
+        self.stages = collections.OrderedDict()
+        self.gauges = collections.OrderedDict()
+        self.events = collections.deque(maxlen=trace_events or 1)
+        self.tracing = trace_events > 0
+        self.threads = {}
+
+    def stage(self, name):
+        if name not in self.stages:
+            self.stages[name] = Stage(self, name)
+        return self.stages[name]
+
+    def gauge(self, name):
+        if name not in self.gauges:
+            self.gauges[name] = Gauge(self, name)
+        return self.gauges[name]
+
+    def _thread(self):
+        thread = threading.current_thread()
+        self.threads[thread.ident] = thread.name
+        return thread.ident
+
+    def _span(self, name, start, end, args):
+        if self.tracing:
+            # deque.append is atomic, so no lock is needed here either.
+            self.events.append(('X', name, start, end - start,
+                                self._thread(), args))
+
+    def _counter(self, name, value):
+        if self.tracing:
+            self.events.append(('C', name, time.perf_counter_ns(), 0,
+                                self._thread(), {name: value}))
+
+    def stats(self):
+        """Summaries of every stage and gauge, since the start and since the
+        previous call."""
+        stats = collections.OrderedDict()
+        for name, stage in self.stages.items():
+            total = stage.merged()
+            interval = total.minus(stage.last)
+            stage.last = total.copy()
+            stats[name] = {'total': total.summary(),
+                           'interval': interval.summary()}
+        for name, gauge in self.gauges.items():
+            stats[name] = {'value': gauge.value, 'max': gauge.max,
+                           'interval_max': gauge.interval_max}
+            gauge.interval_max = gauge.value
+        return stats
+
+    def report(self, total=False):
+        """stats() as lines of text, latencies in microseconds, covering the
+        time since the previous call or, with `total`, since the start."""
+        lines = []
+        stats = self.stats()
+        for name in self.stages:
+            s = stats[name]['total' if total else 'interval']
+            lines.append(
+                '{:<16} {:8d}  mean {:9.1f}  '.format(
+                    name, s['count'], s['mean'] / 1e3) +
+                '  '.join('p{} {:9.1f}'.format(p, s['p{}'.format(p)] / 1e3)
+                          for p in PERCENTILES) +
+                '  max {:9.1f} us'.format(stats[name]['total']['max'] / 1e3))
+        for name in self.gauges:
+            g = stats[name]
+            lines.append('{:<16} {:8d}  max {} ({} overall)'.format(
+                name, g['value'], g['interval_max'], g['max']))
+        return '\n'.join(lines)
+
+    def write_trace(self, path):
+        """Write the traced spans and gauge changes as a Chrome trace."""
+        events = [{'ph': 'M', 'name': 'thread_name', 'pid': 1, 'tid': tid,
+                   'args': {'name': name}}
+                  for tid, name in dict(self.threads).items()]
+        for ph, name, start, duration, tid, args in list(self.events):
+            event = {'ph': ph, 'name': name, 'pid': 1, 'tid': tid,
+                     'ts': (start - self.origin) / 1e3, 'args': args}
+            if ph == 'X':
+                event['dur'] = duration / 1e3
+            events.append(event)
+        with open(path, 'w') as f:
+            json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, f)
+
+
+class DeviceClock(object):
+    """Maps frame timestamps onto the host's perf_counter_ns() clock.
+
+    The offset between the clocks is taken from the frame that arrived
+    soonest after it was stamped, so latencies measured from it are true
+    latencies less the shortest transfer time seen, which is a small
+    constant. It is re-estimated every `window` seconds, with the previous
+    estimate still counting, so drift between the two crystals is followed
+    without losing the best estimate at each change.
+
+    The 32-bit cycle counter wraps (every 86 seconds at 50 MHz), and frame
+    timestamps aren't in order across frame types or channels, since a slow
+    channel's frame is stamped with its first sample. So each timestamp is
+    unwrapped against when it arrived rather than against other timestamps:
+    it is taken to be from the wrap that puts its latency closest to the
+    quickest seen, which is right as long as no frame takes more than half a
+    wrap longer than that.
+    """
+
+    def __init__(self, window=10.0):
+        self.window = int(window * 1e9)
+        self.best = None
+        self.previous = None
+        self.since = None
+        self.received = None
+        # observe() and host_time() are usually called from different
+        # threads.
+        self.lock = threading.Lock()
+
+    def _offset(self):
+        if self.previous is None:
+            return self.best
+        return min(self.best, self.previous)
+
+    def _device_time(self, timestamp, received, offset):
+        """Device time in ns of a frame stamped `timestamp` that arrived at
+        `received`, given the offset between the clocks."""
+        expected = (received - offset) * CLOCK_HZ // 10**9
+        wraps = (expected - timestamp + (1 << 31)) >> 32
+        return ((wraps << 32) + timestamp) * 10**9 // CLOCK_HZ
+
+    def observe(self, timestamp, received):
+        """Note that a frame stamped `timestamp` arrived at `received`."""
+        with self.lock:
+            if self.best is None:
+                offset = received - timestamp * 10**9 // CLOCK_HZ
+            else:
+                offset = received - self._device_time(timestamp, received,
+                                                      self._offset())
+            if self.since is None or received - self.since >= self.window:
+                self.previous = self.best
+                self.best = offset
+                self.since = received
+            elif offset < self.best:
+                self.best = offset
+            self.received = received
+
+    def host_time(self, timestamp):
+        """Host time at which a frame stamped `timestamp` would have arrived
+        had its transfer been the quickest seen.
+
+        The frame must have arrived around the time of the last one observed
+        (within half a wrap of the cycle counter, less its latency), and at
+        least one must have been observed.
+        """
+        with self.lock:
+            offset = self._offset()
+            received = self.received
+        return self._device_time(timestamp, received, offset) + offset
@@ -0,0 +1,45 @@
+"""Closed-loop round-trip latency benchmark.
+
+Puts the device in low-latency mode and repeatedly sends an output value and
+waits for the input sample that comes back, timing each round trip.
+"""
+
+import argparse
+import time
+import numpy as np
+
+from tivadaq import TivaDaq, LOOP_OUTPUT_MAX
+
+PERCENTILES = [50, 90, 99, 99.9]
+
+parser = argparse.ArgumentParser(description=__doc__)
+parser.add_argument('-n', '--iterations', type=int, default=10000,
+                    help='number of timed round trips')
+parser.add_argument('-w', '--warmup', type=int, default=100,
+                    help='untimed round trips before measuring')
+parser.add_argument('--virtual', metavar='HOST:PORT',
+                    help='use a virtual device instead of USB')
+args = parser.parse_args()
+
+daq = TivaDaq(virtual=args.virtual)
+daq.set_low_latency(True)
+
+# Sweep the output so the device has real work to do each time.
+outputs = np.arange(args.warmup + args.iterations) % (LOOP_OUTPUT_MAX + 1)
+
+for i in range(args.warmup):
+    daq.loop(int(outputs[i]), seq=i)
+
+times = np.empty(args.iterations)
+for i in range(args.iterations):
+    t0 = time.perf_counter()
+    daq.loop(int(outputs[args.warmup + i]), seq=i)
+    times[i] = time.perf_counter() - t0
+
+daq.set_low_latency(False)
+
+times *= 1e6
+print('round trips: {}'.format(args.iterations))
+for p in PERCENTILES:
+    print('  p{:<5} {:8.1f} us'.format(p, np.percentile(times, p)))
+print('  max    {:8.1f} us'.format(times.max()))
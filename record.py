@@ -0,0 +1,240 @@
+"""Stream samples from the device to a file and report throughput.
+
+Works against real hardware or, with --virtual, against virtual_device.py,
+which makes it handy for stress-testing the host side at rates the real
+device can't reach.
+
+The stream runs through a pipeline of threads: the main thread reads it,
+a decoder splits it into frames and fans them out, and two consumers take
+them from there, one writing the stream to disk and one counting samples
+and printing telemetry. Every stage is timed (see instrument.py), from each
+read completing, through the queues between the threads, to the write to
+disk, and from each sample block being taken on the device to its reaching
+disk. --stats-s prints the latencies and queue depths as it goes and
+--trace writes a Chrome trace of the run.
+"""
+
+import argparse
+import queue
+import sys
+import threading
+import time
+import traceback
+
+from instrument import Instruments, DeviceClock
+from tivadaq import (TivaDaq, FrameParser, PACKET_SIZE, FRAME_HEADER,
+                     FRAME_SAMPLES, FRAME_REPLY, FRAME_TELEMETRY,
+                     TIMEOUT_ERRORS, parse_samples, parse_telemetry)
+
+# Reads each queue between threads can hold before the one feeding it has
+# to wait.
+QUEUE_DEPTH = 1024
+
+# Longest wait for each read. Nothing arriving in that time is normal, with
+# slow channels, a coalescing hold or credit used up, so it only bounds how
+# late the run ends and stats are printed.
+READ_TIMEOUT_MS = 100
+
+# Spans and queue depth changes kept for --trace.
+TRACE_EVENTS = 1000000
+
+parser = argparse.ArgumentParser(description=__doc__)
+parser.add_argument('-o', '--output', help='file to write raw data to')
+parser.add_argument('-t', '--seconds', type=float, default=5.0,
+                    help='how long to record for')
+parser.add_argument('-b', '--block', type=int, default=16 * PACKET_SIZE,
+                    help='bytes per read')
+parser.add_argument('--packets', type=int, default=0,
+                    help='device-side coalescing, in full packets')
+parser.add_argument('--hold-ms', type=int, default=0,
+                    help='device-side maximum hold time')
+parser.add_argument('--telemetry-ms', type=int, default=0,
+                    help='device telemetry interval, 0 for none')
+parser.add_argument('--credits', type=int, default=0,
+                    help='use flow control with this many bytes of credit '
+                         'outstanding, 0 for none')
+parser.add_argument('--degrade', type=int, default=8,
+                    help='with --credits, average samples down by this much '
+                         'once less than half the credit is left')
+parser.add_argument('--stats-s', type=float, default=0,
+                    help='print pipeline latencies this often, 0 for only '
+                         'at the end')
+parser.add_argument('--trace', metavar='FILE',
+                    help='write a Chrome trace of the pipeline to FILE')
+parser.add_argument('--virtual', metavar='HOST:PORT',
+                    help='use a virtual device instead of USB')
+args = parser.parse_args()
+
+inst = Instruments(trace_events=TRACE_EVENTS if args.trace else 0)
+read_stage = inst.stage('read')
+transfer_stage = inst.stage('read->decode')
+decode_stage = inst.stage('decode')
+to_writer_stage = inst.stage('decode->write')
+to_monitor_stage = inst.stage('decode->monitor')
+write_stage = inst.stage('write')
+sample_stage = inst.stage('sample->disk')
+clock = DeviceClock()
+
+decode_queue = queue.Queue(QUEUE_DEPTH)
+write_queue = queue.Queue(QUEUE_DEPTH)
+monitor_queue = queue.Queue(QUEUE_DEPTH)
+decode_depth = inst.gauge('decode queue')
+write_depth = inst.gauge('write queue')
+monitor_depth = inst.gauge('monitor queue')
+
+daq = TivaDaq(virtual=args.virtual)
+daq.set_coalesce(args.packets, args.hold_ms, zlp=args.block > PACKET_SIZE)
+daq.set_telemetry(args.telemetry_ms)
+if args.credits:
+    daq.grant_credits(args.credits, args.credits // 2, args.degrade)
+
+out = open(args.output, 'wb', buffering=0) if args.output else None
+frames = FrameParser()
+nbytes = 0
+nsamples = 0
+reads = 0
+
+
+def decoder():
+    """Split each read into frames and hand them to both consumers."""
+    while True:
+        item = decode_queue.get()
+        decode_depth.set(decode_queue.qsize())
+        if item is None:
+            break
+        completed, data = item
+        start = time.perf_counter_ns()
+        transfer_stage.record(completed, start)
+
+        chunk = frames.feed(data)
+        for frame in chunk:
+            clock.observe(frame.timestamp, completed)
+        decoded = time.perf_counter_ns()
+        decode_stage.record(start, decoded, frames=len(chunk))
+
+        for q, depth in ((write_queue, write_depth),
+                         (monitor_queue, monitor_depth)):
+            q.put((decoded, data, chunk))
+            depth.set(q.qsize())
+
+    write_queue.put(None)
+    monitor_queue.put(None)
+
+
+def writer():
+    """Write the stream out and hand back the credit for it."""
+    while True:
+        item = write_queue.get()
+        write_depth.set(write_queue.qsize())
+        if item is None:
+            break
+        decoded, data, chunk = item
+        start = time.perf_counter_ns()
+        to_writer_stage.record(decoded, start)
+
+        if out:
+            out.write(data)
+        written = time.perf_counter_ns()
+        write_stage.record(start, written, bytes=len(data))
+
+        consumed = 0
+        for frame in chunk:
+            if frame.type == FRAME_SAMPLES:
+                sample_stage.add(written - clock.host_time(frame.timestamp))
+            if frame.type not in (FRAME_REPLY, FRAME_TELEMETRY):
+                consumed += FRAME_HEADER.size + len(frame.payload)
+        if args.credits and consumed:
+            daq.grant_credits(consumed, args.credits // 2, args.degrade)
+
+
+def monitor():
+    """Count samples and print telemetry."""
+    global nsamples
+    while True:
+        item = monitor_queue.get()
+        monitor_depth.set(monitor_queue.qsize())
+        if item is None:
+            break
+        decoded, data, chunk = item
+        to_monitor_stage.record(decoded, time.perf_counter_ns())
+
+        for frame in chunk:
+            if frame.type == FRAME_SAMPLES:
+                nsamples += len(parse_samples(frame).data)
+            elif frame.type == FRAME_TELEMETRY:
+                print(parse_telemetry(frame))
+
+
+# Exceptions raised by the pipeline threads.
+errors = []
+
+
+def run(target, source, sinks):
+    """Run a pipeline thread. If it fails, keep emptying its queue so the
+    thread feeding it isn't left blocked, and pass the end of the run on to
+    the threads it feeds, so the whole pipeline still winds down."""
+    try:
+        target()
+    except Exception as e:
+        traceback.print_exc()
+        errors.append(e)
+        while source.get() is not None:
+            pass
+        for q in sinks:
+            q.put(None)
+
+
+threads = [threading.Thread(target=run, name=f.__name__,
+                            args=(f, source, sinks))
+           for f, source, sinks in (
+               (decoder, decode_queue, (write_queue, monitor_queue)),
+               (writer, write_queue, ()),
+               (monitor, monitor_queue, ()))]
+for thread in threads:
+    thread.start()
+
+daq.start()
+t0 = time.perf_counter()
+last_stats = t0
+try:
+    while time.perf_counter() - t0 < args.seconds and not errors:
+        start = time.perf_counter_ns()
+        try:
+            data = daq.read_stream(args.block, READ_TIMEOUT_MS)
+        except TIMEOUT_ERRORS:
+            data = b''
+        completed = time.perf_counter_ns()
+
+        if data:
+            read_stage.record(start, completed, bytes=len(data))
+            nbytes += len(data)
+            reads += 1
+
+            decode_queue.put((completed, data))
+            decode_depth.set(decode_queue.qsize())
+
+        if args.stats_s and time.perf_counter() - last_stats >= args.stats_s:
+            last_stats = time.perf_counter()
+            print(inst.report())
+finally:
+    daq.stop()
+    daq.set_telemetry(0)
+    decode_queue.put(None)
+    for thread in threads:
+        thread.join()
+    if args.credits:
+        daq.stop_credits()
+    elapsed = time.perf_counter() - t0
+    if out:
+        out.close()
+
+if errors:
+    sys.exit('pipeline thread failed: {!r}'.format(errors[0]))
+print('{} bytes in {} reads over {:.2f} s'.format(nbytes, reads, elapsed))
+print('{:.3f} MB/s, {:.0f} samples/s'.format(nbytes / elapsed / 1e6,
+                                             nsamples / elapsed))
+print('dropped sample frames: {}'.format(frames.dropped[FRAME_SAMPLES]))
+print(inst.report(total=True))
+if args.trace:
+    inst.write_trace(args.trace)
+    print('trace written to {}'.format(args.trace))
@@ -0,0 +1,445 @@
+//*****************************************************************************
+//
+// channels.c - Multi-rate analog acquisition on ADC0.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "inc/hw_adc.h"
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+#include "driverlib/adc.h"
+#include "driverlib/gpio.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+
+#include "channels.h"
+#include "cycles.h"
+#include "protocol.h"
+#include "sched.h"
+
+// the sequencer used, and its depth
+#define CHANNELS_SEQUENCE 0
+#define CHANNELS_STEPS 8
+
+// the pin behind each analog input
+static const struct {
+    uint32_t periph;
+    uint32_t port;
+    uint8_t pin;
+} g_channels_pins[CHANNELS_MAX_AIN + 1] = {
+    { SYSCTL_PERIPH_GPIOE, GPIO_PORTE_BASE, GPIO_PIN_3 },
+    { SYSCTL_PERIPH_GPIOE, GPIO_PORTE_BASE, GPIO_PIN_2 },
+    { SYSCTL_PERIPH_GPIOE, GPIO_PORTE_BASE, GPIO_PIN_1 },
+    { SYSCTL_PERIPH_GPIOE, GPIO_PORTE_BASE, GPIO_PIN_0 },
+    { SYSCTL_PERIPH_GPIOD, GPIO_PORTD_BASE, GPIO_PIN_3 },
+    { SYSCTL_PERIPH_GPIOD, GPIO_PORTD_BASE, GPIO_PIN_2 },
+    { SYSCTL_PERIPH_GPIOD, GPIO_PORTD_BASE, GPIO_PIN_1 },
+    { SYSCTL_PERIPH_GPIOD, GPIO_PORTD_BASE, GPIO_PIN_0 },
+    { SYSCTL_PERIPH_GPIOE, GPIO_PORTE_BASE, GPIO_PIN_5 },
+    { SYSCTL_PERIPH_GPIOE, GPIO_PORTE_BASE, GPIO_PIN_4 },
+    { SYSCTL_PERIPH_GPIOB, GPIO_PORTB_BASE, GPIO_PIN_4 },
+    { SYSCTL_PERIPH_GPIOB, GPIO_PORTB_BASE, GPIO_PIN_5 },
+};
+
+// the configuration at reset: AIN0 at 32 Hz
+#define CHANNELS_DEFAULT_HZ 32
+static const channels_cmd_t g_channels_default = {
+    CMD_SET_CHANNELS, 1, 0, CHANNELS_DEFAULT_HZ, { { 0, 0, 1 } },
+};
+
+// the configured channels, with the divisors reduced by their common factor
+// and the base period multiplied by it
+static uint8_t g_channels_ain[CHANNELS_MAX];
+static uint16_t g_channels_divisor[CHANNELS_MAX];
+static uint32_t g_channels_period;
+
+// the sequencer programming for each tick of the hyperperiod: the
+// multiplexer and control register values, the number of conversions, and a
+// bit per channel converted, in step order
+static uint32_t g_channels_mux[CHANNELS_MAX_SLOTS];
+static uint32_t g_channels_ctl[CHANNELS_MAX_SLOTS];
+static uint8_t g_channels_steps[CHANNELS_MAX_SLOTS];
+static uint8_t g_channels_due[CHANNELS_MAX_SLOTS];
+static uint32_t g_channels_slots;
+
+// tick of the hyperperiod the sequencer is programmed for, and whether its
+// trigger came while it was being programmed
+static uint32_t g_channels_slot;
+static bool g_channels_torn;
+
+// each channel's pair of buffers, the half being filled, and how far, and
+// the last value converted, which stands in for samples lost to overruns
+static uint16_t g_channels_buf[CHANNELS_MAX][2][CHANNELS_BLOCK];
+static uint8_t g_channels_half[CHANNELS_MAX];
+static uint32_t g_channels_fill[CHANNELS_MAX];
+static uint16_t g_channels_last[CHANNELS_MAX];
+
+// bit 2 * channel + half for each half that has been filled and not yet
+// read, the block number each half holds, and the number of the next block
+// to complete on each channel
+static volatile uint32_t g_channels_ready = 0;
+static volatile uint32_t g_channels_block[CHANNELS_MAX][2];
+static volatile uint32_t g_channels_next_block[CHANNELS_MAX];
+
+// blocks lost because they weren't read in time, and ticks whose results
+// were lost because the interrupt came too late
+static volatile uint32_t g_channels_dropped = 0;
+static volatile uint32_t g_channels_overruns = 0;
+
+static uint32_t g_channels_event;
+static uint32_t g_channels_start;
+
+//*****************************************************************************
+// \return Returns the greatest common divisor of a and b.
+//*****************************************************************************
+static uint32_t gcd(uint32_t a, uint32_t b) {
+    uint32_t t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//*****************************************************************************
+// Set up Timer 0A, sequencer 0 and its interrupt, and configure the default
+// channel. Sampling is left stopped.
+//
+// \param event is the scheduler event to signal when a block is ready.
+//*****************************************************************************
+void channels_init(uint32_t event) {
+    g_channels_event = event;
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_ADC0);
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER0);
+    TimerConfigure(TIMER0_BASE, TIMER_CFG_A_PERIODIC);
+    TimerControlTrigger(TIMER0_BASE, TIMER_A, true);
+
+    // Sequence 3 serves the closed loop at priority 0, so this one comes
+    // second.
+    ADCSequenceConfigure(ADC0_BASE, CHANNELS_SEQUENCE, ADC_TRIGGER_TIMER, 1);
+    ADCIntEnable(ADC0_BASE, CHANNELS_SEQUENCE);
+    IntPrioritySet(INT_ADC0SS0, 0x20);
+    IntEnable(INT_ADC0SS0);
+
+    channels_config(&g_channels_default, SysCtlClockGet() / CHANNELS_DEFAULT_HZ);
+}
+
+//*****************************************************************************
+// Set which analog inputs to sample and how often. Sampling must be stopped.
+//
+// \param config points to the channels and their divisors.
+// \param period is the base period in system clock cycles.
+//
+// \return Returns false, leaving the previous configuration in place, if the
+// configuration is invalid or its hyperperiod is longer than
+// CHANNELS_MAX_SLOTS ticks.
+//*****************************************************************************
+bool channels_config(const channels_cmd_t *config, uint32_t period) {
+    uint32_t count = config->nchannels;
+    uint32_t common = 0;
+    uint32_t slots = 1;
+    uint32_t divisor;
+    uint32_t slot;
+    uint32_t n;
+    uint32_t c;
+
+    if ((count == 0) || (count > CHANNELS_MAX) || (period == 0)) {
+        return false;
+    }
+
+    for (c = 0; c < count; c++) {
+        if ((config->channel[c].ain > CHANNELS_MAX_AIN) ||
+                (config->channel[c].divisor == 0)) {
+            return false;
+        }
+        common = gcd(common, config->channel[c].divisor);
+    }
+
+    for (c = 0; c < count; c++) {
+        divisor = config->channel[c].divisor / common;
+        slots = slots / gcd(slots, divisor) * divisor;
+        if (slots > CHANNELS_MAX_SLOTS) {
+            return false;
+        }
+    }
+
+    if (period > 0xFFFFFFFF / common / slots) {
+        return false;
+    }
+
+    g_channels_period = period * common;
+    g_channels_slots = slots;
+
+    for (c = 0; c < count; c++) {
+        g_channels_ain[c] = config->channel[c].ain;
+        g_channels_divisor[c] = config->channel[c].divisor / common;
+
+        SysCtlPeripheralEnable(g_channels_pins[g_channels_ain[c]].periph);
+        GPIOPinTypeADC(g_channels_pins[g_channels_ain[c]].port,
+                       g_channels_pins[g_channels_ain[c]].pin);
+    }
+
+    for (slot = 0; slot < slots; slot++) {
+        g_channels_mux[slot] = 0;
+        g_channels_due[slot] = 0;
+        n = 0;
+        for (c = 0; c < count; c++) {
+            if (slot % g_channels_divisor[c] == 0) {
+                g_channels_mux[slot] |= (uint32_t)g_channels_ain[c] << (4 * n);
+                g_channels_due[slot] |= 1 << c;
+                n++;
+            }
+        }
+
+        if (n == 0) {
+            g_channels_ctl[slot] = ADC_SSCTL0_TS0;
+            n = 1;
+        }
+        else {
+            g_channels_ctl[slot] = 0;
+        }
+        g_channels_ctl[slot] |= (ADC_SSCTL0_IE0 | ADC_SSCTL0_END0) << (4 * (n - 1));
+        g_channels_steps[slot] = n;
+    }
+
+    return true;
+}
+
+//*****************************************************************************
+// Load the sequencer programming for a tick. The sequencer is left enabled,
+// since it is idle between ticks and a trigger it missed would never raise
+// its interrupt.
+//
+// \param slot is the tick of the hyperperiod.
+//*****************************************************************************
+static void channels_program(uint32_t slot) {
+    HWREG(ADC0_BASE + ADC_O_SSMUX0) = g_channels_mux[slot];
+    HWREG(ADC0_BASE + ADC_O_SSCTL0) = g_channels_ctl[slot];
+}
+
+//*****************************************************************************
+// Start sampling.
+//*****************************************************************************
+void channels_start(void) {
+    bool masked;
+    uint32_t c;
+
+    for (c = 0; c < CHANNELS_MAX; c++) {
+        g_channels_half[c] = 0;
+        g_channels_fill[c] = 0;
+        g_channels_last[c] = 0;
+        g_channels_next_block[c] = 0;
+    }
+    g_channels_ready = 0;
+    g_channels_slot = 0;
+    g_channels_torn = false;
+    channels_program(0);
+    ADCSequenceEnable(ADC0_BASE, CHANNELS_SEQUENCE);
+
+    TimerLoadSet(TIMER0_BASE, TIMER_A, g_channels_period - 1);
+
+    // The first tick comes one base period after the timer starts, which
+    // anchors every sample to the cycle counter.
+    masked = IntMasterDisable();
+    g_channels_start = cycles_now();
+    TimerEnable(TIMER0_BASE, TIMER_A);
+    if (!masked) {
+        IntMasterEnable();
+    }
+}
+
+//*****************************************************************************
+// Stop sampling. Any block not yet read is discarded.
+//*****************************************************************************
+void channels_stop(void) {
+    TimerDisable(TIMER0_BASE, TIMER_A);
+    ADCSequenceDisable(ADC0_BASE, CHANNELS_SEQUENCE);
+    while (!(HWREG(ADC0_BASE + ADC_O_SSFSTAT0) & ADC_SSFSTAT0_EMPTY)) {
+        HWREG(ADC0_BASE + ADC_O_SSFIFO0);
+    }
+    HWREG(ADC0_BASE + ADC_O_OSTAT) = ADC_OSTAT_OV0;
+    ADCIntClear(ADC0_BASE, CHANNELS_SEQUENCE);
+    g_channels_ready = 0;
+}
+
+//*****************************************************************************
+// Add one tick's samples to the channels due in it.
+//
+// \param slot is the tick of the hyperperiod.
+// \param values points to the results in step order, or is 0 to repeat each
+// channel's last value instead.
+//*****************************************************************************
+static void channels_store(uint32_t slot, const uint32_t *values) {
+    uint32_t due = g_channels_due[slot];
+    uint32_t half;
+    uint32_t c;
+
+    while (due) {
+        c = __builtin_ctz(due);
+        due &= due - 1;
+
+        if (values) {
+            g_channels_last[c] = (uint16_t)(*values++ & ADC_SSFIFO0_DATA_M);
+        }
+
+        half = g_channels_half[c];
+        g_channels_buf[c][half][g_channels_fill[c]++] = g_channels_last[c];
+        if (g_channels_fill[c] < CHANNELS_BLOCK) {
+            continue;
+        }
+
+        if (g_channels_ready & (1 << (2 * c + half))) {
+            g_channels_dropped++;
+        }
+        g_channels_block[c][half] = g_channels_next_block[c]++;
+        g_channels_ready |= 1 << (2 * c + half);
+        g_channels_half[c] = half ^ 1;
+        g_channels_fill[c] = 0;
+
+        sched_signal(g_channels_event);
+    }
+}
+
+//*****************************************************************************
+// Interrupt handler for sequencer 0, which fires when a tick's conversions
+// are done.
+//
+// The results are handed to their channels and the sequencer is programmed
+// for the next tick. If this comes so late that the next tick has already
+// been triggered, the FIFO holds more (or, mid-conversion, fewer) results
+// than expected, or has overflowed with a full sequence's worth still in it,
+// and none of them can be trusted. They are thrown away and both ticks
+// repeat their channels' last values, so the timelines stay intact, and the
+// overrun is counted.
+//
+// The sequencer is reprogrammed while it is enabled, so a trigger that comes
+// during that converts some steps of each tick. Timer 0A's timeout flag tells
+// when one did, and that tick's results are thrown away when they arrive.
+//*****************************************************************************
+void ADC0SS0IntHandler(void) {
+    uint32_t values[CHANNELS_STEPS];
+    uint32_t slot = g_channels_slot;
+    uint32_t overflow;
+    uint32_t value;
+    uint32_t n = 0;
+    bool late;
+
+    // Any trigger from here on is for the next tick.
+    TimerIntClear(TIMER0_BASE, TIMER_TIMA_TIMEOUT);
+
+    while (!(HWREG(ADC0_BASE + ADC_O_SSFSTAT0) & ADC_SSFSTAT0_EMPTY)) {
+        value = HWREG(ADC0_BASE + ADC_O_SSFIFO0);
+        if (n < CHANNELS_STEPS) {
+            values[n] = value;
+        }
+        n++;
+    }
+    overflow = HWREG(ADC0_BASE + ADC_O_OSTAT) & ADC_OSTAT_OV0;
+    HWREG(ADC0_BASE + ADC_O_OSTAT) = ADC_OSTAT_OV0;
+    ADCIntClear(ADC0_BASE, CHANNELS_SEQUENCE);
+
+    late = (n != g_channels_steps[slot]) || overflow;
+    if (g_channels_torn) {
+        g_channels_overruns++;
+        channels_store(slot, 0);
+        late = false;
+    }
+    else if (!late) {
+        channels_store(slot, values);
+    }
+    else {
+        g_channels_overruns++;
+        channels_store(slot, 0);
+        slot = (slot + 1 == g_channels_slots) ? 0 : slot + 1;
+        channels_store(slot, 0);
+    }
+
+    slot = (slot + 1 == g_channels_slots) ? 0 : slot + 1;
+    channels_program(slot);
+    g_channels_slot = slot;
+    g_channels_torn = !late &&
+        (TimerIntStatus(TIMER0_BASE, false) & TIMER_TIMA_TIMEOUT);
+}
+
+//*****************************************************************************
+// Copy the oldest finished block of any channel into a FRAME_SAMPLES
+// payload.
+//
+// \param payload points to room for CHANNELS_PAYLOAD_MAX bytes.
+// \param timestamp is set to the time of the first sample in the block.
+//
+// A channel starts refilling a buffer as soon as its other one is full, so a
+// block that was still being copied by then is thrown away and counted as
+// dropped, and the next one is tried.
+//
+// \return Returns the payload length, or 0 if no block is ready.
+//*****************************************************************************
+uint32_t channels_read(uint8_t *payload, uint32_t *timestamp) {
+    samples_header_t *header = (samples_header_t*)payload;
+    uint16_t *samples = (uint16_t*)(payload + sizeof(*header));
+    uint32_t ready;
+    uint32_t half;
+    uint32_t block;
+    uint32_t c;
+    uint32_t i;
+    bool masked;
+
+    while (g_channels_ready) {
+        masked = IntMasterDisable();
+        c = __builtin_ctz(g_channels_ready) / 2;
+        ready = (g_channels_ready >> (2 * c)) & 3;
+        if (ready == 3) {
+            half = ((int32_t)(g_channels_block[c][1] - g_channels_block[c][0]) < 0) ? 1 : 0;
+        }
+        else {
+            half = (ready == 2) ? 1 : 0;
+        }
+        g_channels_ready &= ~(1 << (2 * c + half));
+        block = g_channels_block[c][half];
+        if (!masked) {
+            IntMasterEnable();
+        }
+
+        for (i = 0; i < CHANNELS_BLOCK; i++) {
+            samples[i] = g_channels_buf[c][half][i];
+        }
+
+        if (g_channels_next_block[c] - block >= 2) {
+            g_channels_dropped++;
+            continue;
+        }
+
+        header->channel = c;
+        header->ain = g_channels_ain[c];
+        header->nsamples = CHANNELS_BLOCK;
+        header->period = g_channels_period * g_channels_divisor[c];
+        header->block = block;
+        *timestamp = g_channels_start +
+            g_channels_period * (1 + block * CHANNELS_BLOCK * g_channels_divisor[c]);
+        return sizeof(*header) + CHANNELS_BLOCK * sizeof(uint16_t);
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// \return Returns the number of blocks lost since reset.
+//*****************************************************************************
+uint32_t channels_dropped(void) {
+    return g_channels_dropped;
+}
+
+//*****************************************************************************
+// \return Returns the number of times the sequencer interrupt came too late
+// since reset. Each one costs two ticks' samples.
+//*****************************************************************************
+uint32_t channels_overruns(void) {
+    return g_channels_overruns;
+}
@@ -0,0 +1,331 @@
+//*****************************************************************************
+//
+// envelope.c - Per-window statistics of the analog channels.
+//
+// Sums are kept relative to the level, so a block's worth of squares fits in
+// 32 bits and is only added to the 64-bit window totals once per block.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "envelope.h"
+#include "protocol.h"
+
+// state of one channel
+typedef struct {
+    bool started;
+    uint32_t next_block;    // block the channel should send next
+
+    // the window so far
+    uint32_t count;
+    uint32_t start;         // timestamp of its first sample
+    int64_t sum;            // of samples less the level
+    uint64_t sum_squares;
+    uint16_t min;
+    uint16_t max;
+    uint16_t peak;
+    int8_t side;            // -1 below the level, 1 above, 0 not yet known
+    uint32_t crossings;
+    uint32_t index;
+
+    // the decimated block so far, and the samples of the one being averaged
+    uint16_t decimated[CHANNELS_BLOCK];
+    uint32_t nsamples;
+    uint32_t block_start;
+    uint32_t block;
+    uint32_t group;
+    uint32_t group_sum;
+} envelope_channel_t;
+
+static envelope_channel_t g_channels[CHANNELS_MAX];
+
+static uint32_t g_window = 0;
+static uint16_t g_level = 0;
+static uint16_t g_decimation = 0;
+
+// the last window closed and decimated block filled, until they are read
+static features_t g_features;
+static uint32_t g_features_start;
+static bool g_features_ready = false;
+
+static struct {
+    samples_header_t header;
+    uint16_t samples[CHANNELS_BLOCK];
+} g_samples;
+static uint32_t g_samples_start;
+static bool g_samples_ready = false;
+
+//*****************************************************************************
+// Set the window length, level and decimation, and start every channel over.
+//
+// \param window is the number of samples per window, at least
+// FEATURES_MIN_WINDOW, or 0 to stop.
+// \param level is the level in ADC counts that peak, RMS and crossings are
+// taken about, at most FEATURES_MAX_LEVEL.
+// \param decimation is the number of samples averaged into each decimated
+// sample. Below 2, no decimated samples are produced.
+//*****************************************************************************
+void envelope_config(uint32_t window, uint16_t level, uint16_t decimation) {
+    uint32_t i;
+
+    g_window = window;
+    g_level = level;
+    g_decimation = (decimation > 1) ? decimation : 0;
+
+    for (i = 0; i < CHANNELS_MAX; i++) {
+        g_channels[i].started = false;
+        g_channels[i].index = 0;
+        g_channels[i].block = 0;
+        g_channels[i].nsamples = 0;
+        g_channels[i].group = 0;
+    }
+
+    g_features_ready = false;
+    g_samples_ready = false;
+}
+
+//*****************************************************************************
+// Start a channel's window and decimated block over, after a gap in its
+// blocks or at the start of sampling.
+//
+// \param channel is the channel's state.
+// \param first is true if sampling has just started, so the window and block
+// counts start over too. Otherwise a decimated block that was under way is
+// counted as lost.
+//*****************************************************************************
+static void envelope_restart(envelope_channel_t *channel, bool first) {
+    if (first) {
+        channel->index = 0;
+        channel->block = 0;
+    }
+    else if (channel->nsamples || channel->group) {
+        channel->block++;
+    }
+
+    channel->started = true;
+    channel->count = 0;
+    channel->side = 0;
+    channel->nsamples = 0;
+    channel->group = 0;
+    channel->group_sum = 0;
+}
+
+//*****************************************************************************
+// Fold samples into a channel's window.
+//
+// \param channel is the channel's state.
+// \param samples points to the samples.
+// \param nsamples is the number of them, at most CHANNELS_BLOCK.
+//*****************************************************************************
+static void envelope_fold(envelope_channel_t *channel, const uint16_t *samples,
+                          uint32_t nsamples) {
+    int32_t sum = 0;
+    uint32_t sum_squares = 0;
+    uint32_t crossings = 0;
+    uint16_t min = channel->min;
+    uint16_t max = channel->max;
+    uint16_t peak = channel->peak;
+    int32_t side = channel->side;
+    int32_t d;
+    uint16_t x;
+    uint16_t a;
+    uint32_t i;
+
+    for (i = 0; i < nsamples; i++) {
+        x = samples[i];
+        d = (int32_t)x - g_level;
+        a = (d < 0) ? -d : d;
+
+        sum += d;
+        sum_squares += (uint32_t)(d * d);
+        min = (x < min) ? x : min;
+        max = (x > max) ? x : max;
+        peak = (a > peak) ? a : peak;
+
+        if (d != 0) {
+            d = (d > 0) ? 1 : -1;
+            crossings += (side == -d);
+            side = d;
+        }
+    }
+
+    channel->sum += sum;
+    channel->sum_squares += sum_squares;
+    channel->crossings += crossings;
+    channel->min = min;
+    channel->max = max;
+    channel->peak = peak;
+    channel->side = side;
+}
+
+//*****************************************************************************
+// Close a channel's window and hold its statistics for envelope_read().
+//
+// \param channel is the channel's state.
+// \param header is the header of the block the window ends in.
+//*****************************************************************************
+static void envelope_close(envelope_channel_t *channel,
+                           const samples_header_t *header) {
+    g_features.channel = header->channel;
+    g_features.ain = header->ain;
+    g_features.min = channel->min;
+    g_features.max = channel->max;
+    g_features.peak = channel->peak;
+    g_features.crossings = channel->crossings;
+    g_features.window = g_window;
+    g_features.period = header->period;
+    g_features.index = channel->index++;
+    g_features.mean = g_level + (float)channel->sum / g_window;
+    g_features.rms = sqrtf((float)channel->sum_squares / g_window);
+    g_features_start = channel->start;
+    g_features_ready = true;
+
+    channel->count = 0;
+}
+
+//*****************************************************************************
+// Average a block's samples into a channel's decimated block, and hold that
+// for envelope_read_samples() once it is full.
+//
+// \param channel is the channel's state.
+// \param header is the block's header, followed by its samples.
+// \param timestamp is the time of the block's first sample.
+//*****************************************************************************
+static void envelope_decimate(envelope_channel_t *channel,
+                              const samples_header_t *header,
+                              uint32_t timestamp) {
+    const uint16_t *samples = (const uint16_t*)(header + 1);
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < header->nsamples; i++) {
+        if ((channel->nsamples == 0) && (channel->group == 0)) {
+            channel->block_start = timestamp + i * header->period;
+        }
+
+        channel->group_sum += samples[i];
+        if (++channel->group < g_decimation) {
+            continue;
+        }
+
+        channel->decimated[channel->nsamples++] =
+            (channel->group_sum + g_decimation / 2) / g_decimation;
+        channel->group = 0;
+        channel->group_sum = 0;
+
+        if (channel->nsamples == CHANNELS_BLOCK) {
+            g_samples.header.channel = header->channel;
+            g_samples.header.ain = header->ain;
+            g_samples.header.nsamples = CHANNELS_BLOCK;
+            g_samples.header.period = header->period * g_decimation;
+            g_samples.header.block = channel->block++;
+            for (j = 0; j < CHANNELS_BLOCK; j++) {
+                g_samples.samples[j] = channel->decimated[j];
+            }
+            g_samples_start = channel->block_start;
+            g_samples_ready = true;
+
+            channel->nsamples = 0;
+        }
+    }
+}
+
+//*****************************************************************************
+// Fold a block of samples into its channel's window and decimated block.
+//
+// \param header is the block's header as from channels_read(), followed by
+// its samples.
+// \param timestamp is the time of the block's first sample.
+//*****************************************************************************
+void envelope_add(const samples_header_t *header, uint32_t timestamp) {
+    const uint16_t *samples = (const uint16_t*)(header + 1);
+    envelope_channel_t *channel;
+    uint32_t i;
+    uint32_t n;
+
+    if ((g_window == 0) || (header->channel >= CHANNELS_MAX)) {
+        return;
+    }
+
+    channel = &g_channels[header->channel];
+    if (!channel->started || (header->block == 0) ||
+            (header->block != channel->next_block)) {
+        envelope_restart(channel, header->block == 0);
+    }
+    channel->next_block = header->block + 1;
+
+    for (i = 0; i < header->nsamples; i += n) {
+        if (channel->count == 0) {
+            channel->start = timestamp + i * header->period;
+            channel->sum = 0;
+            channel->sum_squares = 0;
+            channel->min = 0xffff;
+            channel->max = 0;
+            channel->peak = 0;
+            channel->crossings = 0;
+        }
+
+        n = header->nsamples - i;
+        n = (n < g_window - channel->count) ? n : g_window - channel->count;
+        envelope_fold(channel, samples + i, n);
+        channel->count += n;
+
+        if (channel->count == g_window) {
+            envelope_close(channel, header);
+        }
+    }
+
+    if (g_decimation) {
+        envelope_decimate(channel, header, timestamp);
+    }
+}
+
+//*****************************************************************************
+// Take the statistics of the window closed by the last envelope_add(), if
+// there was one.
+//
+// \param features is where to put them.
+// \param timestamp is set to the time of the window's first sample.
+//
+// \return Returns true if a window was closed.
+//*****************************************************************************
+bool envelope_read(features_t *features, uint32_t *timestamp) {
+    if (!g_features_ready) {
+        return false;
+    }
+
+    *features = g_features;
+    *timestamp = g_features_start;
+    g_features_ready = false;
+    return true;
+}
+
+//*****************************************************************************
+// Take the decimated block filled by the last envelope_add(), if there was
+// one.
+//
+// \param payload is where to put a samples_header_t followed by the samples,
+// ENVELOPE_PAYLOAD_MAX bytes.
+// \param timestamp is set to the time of the first sample averaged into the
+// block.
+//
+// \return Returns the payload length, or 0 if no block was filled.
+//*****************************************************************************
+uint32_t envelope_read_samples(uint8_t *payload, uint32_t *timestamp) {
+    const uint8_t *block = (const uint8_t*)&g_samples;
+    uint32_t i;
+
+    if (!g_samples_ready) {
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(g_samples); i++) {
+        payload[i] = block[i];
+    }
+    *timestamp = g_samples_start;
+    g_samples_ready = false;
+    return sizeof(g_samples);
+}
@@ -0,0 +1,259 @@
+//*****************************************************************************
+//
+// logic.c - Logic-analyzer capture of GPIO port B.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "inc/hw_gpio.h"
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
+#include "driverlib/gpio.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+#include "driverlib/udma.h"
+
+#include "cycles.h"
+#include "logic.h"
+#include "protocol.h"
+#include "sched.h"
+
+// the port B data register, with all eight pins unmasked
+#define LOGIC_PORT_DATA (GPIO_PORTB_BASE + GPIO_O_DATA + (0xFF << 2))
+
+// the two halves of the ping-pong transfer
+static const uint32_t g_logic_select[2] = { UDMA_PRI_SELECT, UDMA_ALT_SELECT };
+static uint8_t g_logic_buf[2][LOGIC_BLOCK];
+
+// bit per half that has been filled and not yet read, the block number each
+// half holds, and the number of the next block to complete
+static volatile uint32_t g_logic_ready = 0;
+static volatile uint32_t g_logic_block[2];
+static volatile uint32_t g_logic_next_block = 0;
+
+// half that completes next
+static uint32_t g_logic_half = 0;
+
+// blocks lost because they weren't read in time
+static volatile uint32_t g_logic_dropped = 0;
+
+static uint32_t g_logic_event;
+static uint32_t g_logic_period;
+static uint32_t g_logic_start;
+static uint8_t g_logic_mask;
+
+//*****************************************************************************
+// Set up port B, Timer 1A and the uDMA channel. Capture is left stopped.
+//
+// \param event is the scheduler event to signal when a block is ready.
+//*****************************************************************************
+void logic_init(uint32_t event) {
+    g_logic_event = event;
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_GPIOB);
+    GPIOPinTypeGPIOInput(GPIO_PORTB_BASE, 0xFF);
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER1);
+    TimerConfigure(TIMER1_BASE, TIMER_CFG_PERIODIC);
+
+    // Each timer timeout requests a single byte transfer from the port into
+    // the current buffer.
+    uDMAChannelAssign(UDMA_CH20_TIMER1A);
+    uDMAChannelAttributeDisable(UDMA_CHANNEL_TMR1A,
+                                UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST |
+                                UDMA_ATTR_HIGH_PRIORITY | UDMA_ATTR_REQMASK);
+    uDMAChannelControlSet(UDMA_CHANNEL_TMR1A | UDMA_PRI_SELECT,
+                          UDMA_SIZE_8 | UDMA_SRC_INC_NONE | UDMA_DST_INC_8 |
+                          UDMA_ARB_1);
+    uDMAChannelControlSet(UDMA_CHANNEL_TMR1A | UDMA_ALT_SELECT,
+                          UDMA_SIZE_8 | UDMA_SRC_INC_NONE | UDMA_DST_INC_8 |
+                          UDMA_ARB_1);
+
+    // The block deadline is short at high rates, so this shares the sample
+    // timer's priority.
+    TimerIntEnable(TIMER1_BASE, TIMER_TIMA_DMA);
+    IntPrioritySet(INT_TIMER1A, 0x20);
+    IntEnable(INT_TIMER1A);
+}
+
+//*****************************************************************************
+// Start capturing.
+//
+// \param period is the time between samples in system clock cycles.
+// \param mask selects the pins to capture.
+//*****************************************************************************
+void logic_start(uint32_t period, uint8_t mask) {
+    bool masked;
+
+    g_logic_period = period;
+    g_logic_mask = mask;
+    g_logic_ready = 0;
+    g_logic_next_block = 0;
+    g_logic_half = 0;
+
+    uDMAChannelTransferSet(UDMA_CHANNEL_TMR1A | UDMA_PRI_SELECT,
+                           UDMA_MODE_PINGPONG, (void*)LOGIC_PORT_DATA,
+                           g_logic_buf[0], LOGIC_BLOCK);
+    uDMAChannelTransferSet(UDMA_CHANNEL_TMR1A | UDMA_ALT_SELECT,
+                           UDMA_MODE_PINGPONG, (void*)LOGIC_PORT_DATA,
+                           g_logic_buf[1], LOGIC_BLOCK);
+    uDMAChannelEnable(UDMA_CHANNEL_TMR1A);
+
+    TimerLoadSet(TIMER1_BASE, TIMER_A, period - 1);
+
+    // The first sample is taken one period after the timer starts, which
+    // anchors every sample to the cycle counter.
+    masked = IntMasterDisable();
+    g_logic_start = cycles_now();
+    TimerEnable(TIMER1_BASE, TIMER_A);
+    if (!masked) {
+        IntMasterEnable();
+    }
+}
+
+//*****************************************************************************
+// Stop capturing. Any block not yet read is discarded.
+//*****************************************************************************
+void logic_stop(void) {
+    TimerDisable(TIMER1_BASE, TIMER_A);
+    uDMAChannelDisable(UDMA_CHANNEL_TMR1A);
+    g_logic_ready = 0;
+}
+
+//*****************************************************************************
+// Interrupt handler for Timer 1A, which fires when the uDMA has filled one
+// half of the ping-pong buffer.
+//
+// The finished half is set up again right away, so the uDMA moves on to it
+// without a break once the other half fills.
+//*****************************************************************************
+void Timer1IntHandler(void) {
+    uint32_t half = g_logic_half;
+
+    TimerIntClear(TIMER1_BASE, TIMER_TIMA_DMA);
+
+    if (uDMAChannelModeGet(UDMA_CHANNEL_TMR1A | g_logic_select[half]) !=
+            UDMA_MODE_STOP) {
+        return;
+    }
+
+    if (g_logic_ready & (1 << half)) {
+        g_logic_dropped++;
+    }
+    g_logic_block[half] = g_logic_next_block++;
+    g_logic_ready |= 1 << half;
+
+    uDMAChannelTransferSet(UDMA_CHANNEL_TMR1A | g_logic_select[half],
+                           UDMA_MODE_PINGPONG, (void*)LOGIC_PORT_DATA,
+                           g_logic_buf[half], LOGIC_BLOCK);
+    g_logic_half = half ^ 1;
+
+    sched_signal(g_logic_event);
+}
+
+//*****************************************************************************
+// Run-length encode a block of samples, falling back to raw samples if that
+// doesn't make it smaller.
+//
+// \param samples points to LOGIC_BLOCK samples.
+// \param out points to room for LOGIC_BLOCK bytes.
+// \param encoding is set to LOGIC_RLE or LOGIC_RAW.
+//
+// \return Returns the number of bytes written to out.
+//*****************************************************************************
+static uint32_t logic_encode(const uint8_t *samples, uint8_t *out, uint8_t *encoding) {
+    uint8_t mask = g_logic_mask;
+    uint8_t value = samples[0] & mask;
+    uint8_t sample;
+    uint32_t run = 0;
+    uint32_t n = 0;
+    uint32_t i;
+
+    for (i = 0; i <= LOGIC_BLOCK; i++) {
+        sample = (i < LOGIC_BLOCK) ? (samples[i] & mask) : ~value;
+
+        if ((sample != value) || (run == 256)) {
+            if (n + 2 >= LOGIC_BLOCK) {
+                break;
+            }
+            out[n++] = value;
+            out[n++] = (uint8_t)(run - 1);
+            value = sample;
+            run = 0;
+        }
+        run++;
+    }
+
+    if (i > LOGIC_BLOCK) {
+        *encoding = LOGIC_RLE;
+        return n;
+    }
+
+    for (i = 0; i < LOGIC_BLOCK; i++) {
+        out[i] = samples[i] & mask;
+    }
+    *encoding = LOGIC_RAW;
+    return LOGIC_BLOCK;
+}
+
+//*****************************************************************************
+// Encode the oldest captured block as a FRAME_LOGIC payload.
+//
+// \param payload points to room for LOGIC_PAYLOAD_MAX bytes.
+// \param timestamp is set to the time of the first sample in the block.
+//
+// The uDMA starts refilling a buffer as soon as the other one is full, so a
+// block that was still being encoded by then is thrown away and counted as
+// dropped, and the next one is tried.
+//
+// \return Returns the payload length, or 0 if no block is ready.
+//*****************************************************************************
+uint32_t logic_read(uint8_t *payload, uint32_t *timestamp) {
+    logic_header_t *header = (logic_header_t*)payload;
+    uint32_t half;
+    uint32_t block;
+    uint32_t n;
+    bool masked;
+
+    while (g_logic_ready) {
+        masked = IntMasterDisable();
+        if (g_logic_ready == 3) {
+            half = ((int32_t)(g_logic_block[1] - g_logic_block[0]) < 0) ? 1 : 0;
+        }
+        else {
+            half = (g_logic_ready == 2) ? 1 : 0;
+        }
+        g_logic_ready &= ~(1 << half);
+        block = g_logic_block[half];
+        if (!masked) {
+            IntMasterEnable();
+        }
+
+        n = logic_encode(g_logic_buf[half], payload + sizeof(*header),
+                         &header->encoding);
+
+        if (g_logic_next_block - block >= 2) {
+            g_logic_dropped++;
+            continue;
+        }
+
+        header->mask = g_logic_mask;
+        header->nsamples = LOGIC_BLOCK;
+        header->period = g_logic_period;
+        header->block = block;
+        *timestamp = g_logic_start + g_logic_period * (1 + block * LOGIC_BLOCK);
+        return sizeof(*header) + n;
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// \return Returns the number of blocks lost since reset.
+//*****************************************************************************
+uint32_t logic_dropped(void) {
+    return g_logic_dropped;
+}
@@ -27,15 +27,18 @@
 #include "inc/hw_ints.h"
 #include "inc/hw_memmap.h"
 #include "inc/hw_types.h"
+#include "driverlib/adc.h"
 #include "driverlib/debug.h"
 #include "driverlib/fpu.h"
 #include "driverlib/gpio.h"
 #include "driverlib/interrupt.h"
 #include "driverlib/pin_map.h"
+#include "driverlib/pwm.h"
 #include "driverlib/sysctl.h"
 #include "driverlib/systick.h"
 #include "driverlib/timer.h"
 #include "driverlib/uart.h"
+#include "driverlib/udma.h"
 #include "driverlib/rom.h"
 #include "driverlib/timer.h"
 #include "usblib/usblib.h"
@@ -45,15 +48,38 @@
 #include "utils/uartstdio.h"
 #include "utils/ustdlib.h"
 
+#include "channels.h"
+#include "cycles.h"
+#include "envelope.h"
+#include "logic.h"
+#include "persist.h"
+#include "protocol.h"
+#include "sched.h"
+#include "spectrum.h"
+#include "spi.h"
+#include "stack.h"
 #include "usb_structs.h"
 
 // system tick rate
-#define SYSTICKS_PER_SECOND 100
+#define SYSTICKS_PER_SECOND 1000
 #define SYSTICK_PERIOD_MS   (1000 / SYSTICKS_PER_SECOND)
 
-// flags used to pass commands from interrupt context to the main loop.
-#define COMMAND_PACKET_RECEIVED 0x00000001
-#define COMMAND_STATUS_UPDATE   0x00000002
+// scheduler events, in priority order (see sched.h)
+#define EVENT_USB_FLUSH     0   // held-back transmit data is due
+#define EVENT_LOGIC         1   // logic-analyzer block captured
+#define EVENT_SPI           2   // SPI sensor block received
+#define EVENT_SAMPLE        3   // analog sample block ready
+#define EVENT_COMMAND       4   // commands waiting in g_commands
+#define EVENT_STATUS_UPDATE 5   // telemetry frame is due
+
+// commands received by the USB interrupt and waiting for the command task
+#define COMMAND_QUEUE_DEPTH 4
+uint8_t g_commands[COMMAND_QUEUE_DEPTH][COMMAND_MAX_SIZE];
+volatile uint32_t g_command_head = 0;
+volatile uint32_t g_command_tail = 0;
+
+// where a credit grant is copied, since it is handled without being queued
+uint8_t g_grant[COMMAND_MAX_SIZE];
 
 // global system tick counter
 volatile uint32_t g_sys_tick_count = 0;
@@ -65,8 +91,67 @@ volatile uint32_t g_rx_count = 0;
 // global flag indicating that a USB configuration has been set
 volatile bool g_usb_configured = false;
 
+// low-latency (closed-loop) mode, see CMD_SET_LOW_LATENCY
+volatile bool g_low_latency = false;
+
 volatile bool g_timer_enabled = false;
-volatile uint8_t g_timer_event = 0;
+
+// spectral mode on channel 0, see CMD_SET_SPECTRUM, and the most cycles one
+// window has taken since the last telemetry frame
+bool g_spectrum_on = false;
+bool g_spectrum_raw = false;
+uint32_t g_fft_cycles = 0;
+struct {
+    spectrum_header_t header;
+    float bins[SPECTRUM_BINS];
+} g_spectrum;
+
+// feature mode on every channel, see CMD_SET_FEATURES, and the samples
+// averaged into each one sent
+bool g_features_on = false;
+uint16_t g_features_decimation = 0;
+
+// stored settings are replayed once USB is first configured after reset
+volatile bool g_resume = false;
+
+// cycle counter at the first analog sample after reset
+uint32_t g_boot_cycles = 0;
+
+// uDMA channel control table, which must be 1024-byte aligned
+uint8_t g_udma_control[1024] __attribute__((aligned(1024)));
+
+// transmit coalescing policy, see CMD_SET_COALESCE. Bytes written to the
+// transmit buffer are held back until g_coalesce_packets full packets are
+// waiting or the oldest byte has been held for g_coalesce_hold_ms.
+volatile uint8_t g_coalesce_packets = 0;
+volatile uint16_t g_coalesce_hold_ms = 0;
+volatile bool g_coalesce_zlp = false;
+
+// bytes in the transmit buffer not yet handed to the USB library, and the
+// tick count when the oldest of them was written
+volatile uint32_t g_tx_pending = 0;
+volatile uint32_t g_tx_pending_tick = 0;
+
+// per-type frame sequence numbers
+uint8_t g_frame_seq[FRAME_TYPE_COUNT];
+
+// credit-based flow control, see CMD_GRANT_CREDITS: the balance in bytes,
+// how the samples are averaged down below the low-water mark, and the
+// frames that has happened to or that were not sent at all
+volatile bool g_credits_on = false;
+volatile uint32_t g_credits = 0;
+volatile uint32_t g_credit_low_water = 0;
+volatile uint16_t g_credit_decimation = 1;
+volatile uint32_t g_degraded_frames = 0;
+volatile uint32_t g_throttled_frames = 0;
+
+// telemetry, see CMD_SET_TELEMETRY
+volatile uint16_t g_telemetry_ms = 0;
+volatile uint32_t g_telemetry_tick = 0;
+volatile uint32_t g_dropped_frames = 0;
+volatile uint32_t g_dropped_samples = 0;
+volatile uint32_t g_tx_fill_min = BULK_BUFFER_SIZE;
+volatile uint32_t g_tx_fill_max = 0;
 
 #ifdef DEBUG
 // map all debug print calls to UARTprintf in debug builds.
@@ -82,114 +167,467 @@ void __error__(char *fname, uint32_t lnum) {
 #endif
 
 //*****************************************************************************
-// Interrupt handler for the system tick counter.
+// Hand any held-back transmit data to the USB library.
+//
+// Must be called with interrupts masked.
 //*****************************************************************************
-void SysTickIntHandler(void) {
-    g_sys_tick_count++;
+static void usb_flush(void) {
+    if (g_tx_pending) {
+        USBBufferDataWritten(&g_tx_cb_buf, g_tx_pending);
+        g_tx_pending = 0;
+    }
 }
 
 //*****************************************************************************
-// Receive new data and echo it back to the host.
+// Copy bytes into the transmit ring buffer.
 //
-// \param device points to the instance data for the device whose data is to
-// be processed.
-// \param data points to the newly received data in the USB receive buffer.
-// \param nbytes is the number of bytes of data available to be processed.
+// \param idx points to the write position, which is advanced past the data.
+// \param data points to the bytes to copy.
+// \param nbytes is the number of bytes to copy.
+//*****************************************************************************
+static void tx_copy(uint32_t *idx, const void *data, uint32_t nbytes) {
+    const uint8_t *ptr = (const uint8_t*)data;
+    uint32_t idx_write = *idx;
+    uint32_t i;
+
+    for (i = 0; i < nbytes; i++) {
+        g_usb_tx_buf[idx_write] = ptr[i];
+        idx_write++;
+        idx_write = (idx_write == BULK_BUFFER_SIZE) ? 0 : idx_write;
+    }
+    *idx = idx_write;
+}
+
+//*****************************************************************************
+// Queue a frame for transmission to the host.
 //
-// This function is called whenever we receive a notification that data is
-// available from the host. We read the data, byte-by-byte and swap the case
-// of any alphabetical characters found then write it back out to be
-// transmitted back to the host.
+// \param type is the frame type (FRAME_*).
+// \param timestamp is the cycle counter value to put in the frame header.
+// \param payload points to the frame payload.
+// \param length is the number of payload bytes.
 //
-// \return Returns the number of bytes of data processed.
+// The frame is copied straight into the transmit ring buffer behind anything
+// already held there by the coalescing policy, and handed to the USB library
+// once the policy says so. In low-latency mode, or with coalescing off, it is
+// handed over right away. This is called from both the main loop and the USB
+// interrupt, so interrupts are masked while the ring buffer indices are being
+// updated.
+//
+// With flow control on, frames other than replies and telemetry also need
+// enough credit, which they use up.
+//
+// \return Returns false (and writes nothing) if there is not enough space in
+// the transmit buffer for the whole frame, or not enough credit. The frame
+// still uses up a sequence number so the host can tell that it is missing.
 //*****************************************************************************
-static uint32_t parse_command(tUSBDBulkDevice *device, uint8_t *data, uint32_t nbytes) {
-    uint32_t idx_loop;
-    uint32_t space;
-    uint32_t count;
-    uint32_t idx_read;
+static bool frame_send_at(uint8_t type, uint32_t timestamp, const void *payload,
+                          uint16_t length) {
+    frame_header_t header;
     uint32_t idx_write;
+    uint32_t nbytes = sizeof(header) + length;
+    uint32_t fill;
     tUSBRingBufObject tx_buf;
+    bool metered;
+    bool masked;
+
+    header.type = type;
+    header.length = length;
+    header.timestamp = timestamp;
+
+    masked = IntMasterDisable();
+
+    header.seq = g_frame_seq[type]++;
+
+    metered = g_credits_on && (type != FRAME_REPLY) && (type != FRAME_TELEMETRY);
+    if (metered && (g_credits < nbytes)) {
+        g_throttled_frames++;
+        if (!masked) {
+            IntMasterEnable();
+        }
+        return false;
+    }
+
+    if (USBBufferSpaceAvailable(&g_tx_cb_buf) < g_tx_pending + nbytes) {
+        g_dropped_frames++;
+        if (!masked) {
+            IntMasterEnable();
+        }
+        return false;
+    }
 
-    // Get the current buffer information to allow us to write directly to
-    // the transmit buffer (we already have enough information from the
-    // parameters to access the receive buffer directly).
     USBBufferInfoGet(&g_tx_cb_buf, &tx_buf);
+    idx_write = (tx_buf.ui32WriteIndex + g_tx_pending) % BULK_BUFFER_SIZE;
+    tx_copy(&idx_write, &header, sizeof(header));
+    tx_copy(&idx_write, payload, length);
+
+    if (g_tx_pending == 0) {
+        g_tx_pending_tick = g_sys_tick_count;
+    }
+    g_tx_pending += nbytes;
+    if (metered) {
+        g_credits -= nbytes;
+    }
 
-    // How much space is there in the transmit buffer?
-    space = USBBufferSpaceAvailable(&g_tx_cb_buf);
+    fill = USBBufferDataAvailable(&g_tx_cb_buf) + g_tx_pending;
+    g_tx_fill_max = (fill > g_tx_fill_max) ? fill : g_tx_fill_max;
 
-    // How many characters can we process this time round?
-    count = (space < nbytes) ? space : nbytes;
-    idx_loop = count;
+    if (g_low_latency || (g_tx_pending >= g_coalesce_packets * BULK_PACKET_SIZE)) {
+        usb_flush();
+    }
 
-    // Update our receive counter.
-    g_rx_count += nbytes;
+    if (!masked) {
+        IntMasterEnable();
+    }
+    return true;
+}
 
-    DEBUG_PRINT("Received %d bytes\n", nbytes);
+//*****************************************************************************
+// Queue a frame stamped with the current time, see frame_send_at().
+//*****************************************************************************
+static bool frame_send(uint8_t type, const void *payload, uint16_t length) {
+    return frame_send_at(type, cycles_now(), payload, length);
+}
+
+//*****************************************************************************
+// Interrupt handler for the system tick counter.
+//
+// This also signals when held-back transmit data has reached the maximum
+// hold time of the coalescing policy and when a telemetry frame is due.
+//*****************************************************************************
+void SysTickIntHandler(void) {
+    g_sys_tick_count++;
+
+    if (g_telemetry_ms &&
+            (g_sys_tick_count - g_telemetry_tick >= g_telemetry_ms / SYSTICK_PERIOD_MS)) {
+        g_telemetry_tick = g_sys_tick_count;
+        sched_signal(EVENT_STATUS_UPDATE);
+    }
+
+    if (g_tx_pending && g_coalesce_hold_ms &&
+            (g_sys_tick_count - g_tx_pending_tick >= g_coalesce_hold_ms / SYSTICK_PERIOD_MS)) {
+        sched_signal(EVENT_USB_FLUSH);
+    }
+}
+
+//*****************************************************************************
+// Start or stop the sample timer.
+//
+// \param enable is true to start it. Nothing changes if it is already in
+// that state.
+//*****************************************************************************
+static void set_timer(bool enable) {
+    if (enable == g_timer_enabled) {
+        return;
+    }
 
     if (g_timer_enabled) {
         UARTprintf("disabling timer\n");
-        TimerDisable(TIMER0_BASE, TIMER_A);
+        channels_stop();
     }
     else {
         UARTprintf("enabling timer\n");
-        TimerEnable(TIMER0_BASE, TIMER_A);
+        channels_start();
     }
-    g_timer_enabled = !g_timer_enabled;
+    g_timer_enabled = enable;
+    persist_streaming(g_timer_enabled);
+}
 
-    // Set up to process the characters by directly accessing the USB buffers.
-    idx_read = (uint32_t)(data - g_usb_rx_buf);
-    idx_write = tx_buf.ui32WriteIndex;
+//*****************************************************************************
+// Set the PWM output used by the closed-loop command.
+//
+// \param value is the duty cycle in counts, from 0 to LOOP_OUTPUT_MAX.
+//
+// The PWM generator can't produce a zero-width pulse, so a value of zero
+// turns the output off instead.
+//*****************************************************************************
+static void pwm_set(uint16_t value) {
+    if (value == 0) {
+        PWMOutputState(PWM0_BASE, PWM_OUT_4_BIT, false);
+        return;
+    }
 
-    /*
-    while (idx_loop) {
-        // convert lowercase to uppercase and vice versa
-        if ((g_usb_rx_buf[idx_read] >= 'a') && (g_usb_rx_buf[idx_read] <= 'z')) {
-            g_usb_tx_buf[idx_write] = (g_usb_rx_buf[idx_read] - 'a') + 'A';
+    value = (value > LOOP_OUTPUT_MAX) ? LOOP_OUTPUT_MAX : value;
+    PWMPulseWidthSet(PWM0_BASE, PWM_OUT_4, value);
+    PWMOutputState(PWM0_BASE, PWM_OUT_4_BIT, true);
+}
+
+//*****************************************************************************
+// Take a single ADC sample.
+//
+// This triggers sequence 3 and busy-waits for the conversion, which takes
+// about 1 us at the default 1 Msps rate. That is short enough to do from the
+// USB interrupt.
+//
+// \return Returns the 12-bit conversion result.
+//*****************************************************************************
+static uint16_t adc_read(void) {
+    uint32_t value;
+
+    ADCProcessorTrigger(ADC0_BASE, 3);
+    while (!ADCIntStatus(ADC0_BASE, 3, false)) {}
+    ADCIntClear(ADC0_BASE, 3);
+    ADCSequenceDataGet(ADC0_BASE, 3, &value);
+
+    return (uint16_t)value;
+}
+
+//*****************************************************************************
+// Carry out a command from the host.
+//
+// \param cmd points to the command, COMMAND_MAX_SIZE bytes long. The first
+// byte is the command opcode (see protocol.h). Anything that isn't a known
+// opcode toggles the sample timer.
+//
+// Settings commands that are accepted are also stored, see persist.h. None
+// of those are handled from the USB interrupt.
+//*****************************************************************************
+static void handle_command(uint8_t *cmd) {
+    switch (cmd[0]) {
+        case CMD_LOOP: {
+            loop_cmd_t *loop = (loop_cmd_t*)cmd;
+            loop_reply_t reply = { CMD_LOOP };
+
+            pwm_set(loop->output);
+            reply.seq = loop->seq;
+            reply.sample = adc_read();
+            frame_send(FRAME_REPLY, &reply, sizeof(reply));
+            break;
         }
-        else if ((g_usb_rx_buf[idx_read] >= 'A') && (g_usb_rx_buf[idx_read] <= 'Z')) {
-            g_usb_tx_buf[idx_write] = (g_usb_rx_buf[idx_read] - 'Z') + 'z';
+
+        case CMD_SET_LOW_LATENCY: {
+            g_low_latency = (cmd[1] != 0);
+
+            // Streaming would queue up behind the loop replies, so it is
+            // stopped for the duration.
+            if (g_low_latency) {
+                set_timer(false);
+            }
+            break;
         }
-        else {
-            g_usb_tx_buf[idx_write] = g_usb_rx_buf[idx_read];
+
+        case CMD_SET_COALESCE: {
+            coalesce_cmd_t *coalesce = (coalesce_cmd_t*)cmd;
+            bool masked;
+
+            masked = IntMasterDisable();
+            g_coalesce_packets = (coalesce->packets > COALESCE_MAX_PACKETS) ?
+                COALESCE_MAX_PACKETS : coalesce->packets;
+            g_coalesce_hold_ms = coalesce->hold_ms;
+            g_coalesce_zlp = (coalesce->flags & COALESCE_ZLP) != 0;
+            usb_flush();
+            if (!masked) {
+                IntMasterEnable();
+            }
+            persist_save(cmd);
+            break;
         }
 
-        // Move to the next character taking care to adjust the pointer for
-        // the buffer wrap if necessary.
-        idx_write++;
-        idx_write = (idx_write == BULK_BUFFER_SIZE) ? 0 : idx_write;
-        idx_read++;
-        idx_read = (idx_read == BULK_BUFFER_SIZE) ? 0 : idx_read;
+        case CMD_GET_STACK: {
+            stack_reply_t reply = { CMD_GET_STACK };
+            reply.size = StackSize();
+            reply.high_water = StackHighWater();
+            frame_send(FRAME_REPLY, &reply, sizeof(reply));
+            break;
+        }
+
+        case CMD_SET_TELEMETRY: {
+            telemetry_cmd_t *telemetry = (telemetry_cmd_t*)cmd;
+
+            g_telemetry_tick = g_sys_tick_count;
+            g_telemetry_ms = telemetry->interval_ms;
+            persist_save(cmd);
+            break;
+        }
+
+        case CMD_SET_LOGIC: {
+            logic_cmd_t *logic = (logic_cmd_t*)cmd;
+            uint32_t rate = logic->rate_hz;
+
+            logic_stop();
+            if (rate) {
+                rate = (rate > LOGIC_MAX_RATE) ? LOGIC_MAX_RATE : rate;
+                logic_start(SysCtlClockGet() / rate, logic->mask);
+            }
+            persist_save(cmd);
+            break;
+        }
+
+        case CMD_SET_SPECTRUM: {
+            spectrum_cmd_t *spectrum = (spectrum_cmd_t*)cmd;
+
+            spectrum_config(spectrum->averages);
+            g_spectrum.header.averages = spectrum->averages;
+            g_spectrum_on = (spectrum->averages != 0);
+            g_spectrum_raw = (spectrum->flags & SPECTRUM_RAW) != 0;
+            persist_save(cmd);
+            break;
+        }
 
-        idx_loop--;
+        case CMD_SET_FEATURES: {
+            features_cmd_t *features = (features_cmd_t*)cmd;
+
+            if (((features->window != 0) &&
+                    (features->window < FEATURES_MIN_WINDOW)) ||
+                    (features->level > FEATURES_MAX_LEVEL)) {
+                DEBUG_PRINT("Bad feature settings\n");
+                break;
+            }
+
+            envelope_config(features->window, features->level,
+                            features->decimation);
+            g_features_on = (features->window != 0);
+            g_features_decimation = features->decimation;
+            persist_save(cmd);
+            break;
+        }
+
+        case CMD_SET_SPI: {
+            spi_cmd_t *spi = (spi_cmd_t*)cmd;
+            uint32_t rate = spi->rate_hz;
+
+            // A bad command leaves any running acquisition alone.
+            if (rate && !spi_valid(spi)) {
+                DEBUG_PRINT("Bad SPI settings\n");
+                break;
+            }
+            spi_stop();
+            if (rate) {
+                rate = (rate > SPI_MAX_RATE) ? SPI_MAX_RATE : rate;
+                spi_start(spi, SysCtlClockGet() / rate);
+            }
+            persist_save(cmd);
+            break;
+        }
+
+        case CMD_SET_CHANNELS: {
+            channels_cmd_t *channels = (channels_cmd_t*)cmd;
+            uint32_t rate = channels->base_hz;
+
+            if (g_timer_enabled) {
+                channels_stop();
+            }
+            if ((rate == 0) || (rate > CHANNELS_MAX_RATE) ||
+                    !channels_config(channels, SysCtlClockGet() / rate)) {
+                DEBUG_PRINT("Bad channel settings\n");
+            }
+            else {
+                persist_save(cmd);
+            }
+            if (g_timer_enabled) {
+                channels_start();
+            }
+            break;
+        }
+
+        case CMD_GRANT_CREDITS: {
+            credits_cmd_t *grant = (credits_cmd_t*)cmd;
+            bool masked;
+
+            if (!(grant->flags & CREDITS_ON)) {
+                g_credits_on = false;
+                break;
+            }
+            if ((grant->decimation == 0) ||
+                    (CHANNELS_BLOCK % grant->decimation != 0)) {
+                DEBUG_PRINT("Bad credit settings\n");
+                break;
+            }
+
+            masked = IntMasterDisable();
+            g_credits = (g_credits_on ? g_credits : 0) + grant->credits;
+            if (g_credits < grant->credits) {
+                g_credits = UINT32_MAX;
+            }
+            g_credit_low_water = grant->low_water;
+            g_credit_decimation = grant->decimation;
+            g_credits_on = true;
+            if (!masked) {
+                IntMasterEnable();
+            }
+            break;
+        }
+
+        case CMD_CLEAR_CONFIG: {
+            persist_clear();
+            break;
+        }
+
+        case CMD_SET_STREAMING: {
+            set_timer(cmd[1] != 0);
+            break;
+        }
+
+        default:
+            set_timer(!g_timer_enabled);
+            break;
     }
-    */
+}
 
-    //float samples[] = {
-    //    0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0,
-    //    8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0,
-    //};
-    //uint32_t bufsize = sizeof(samples);
-    //uint8_t *ptr = (uint8_t*)&samples;
-    //uint8_t i;
+//*****************************************************************************
+// Accept a command packet from the host.
+//
+// \param device points to the instance data for the device whose data is to
+// be processed.
+// \param data points to the newly received data in the USB receive buffer.
+// \param nbytes is the number of bytes of data available to be processed.
+//
+// This function is called in the USB interrupt whenever we receive a
+// notification that data is available from the host. The command is queued
+// for the command task, except that CMD_LOOP is answered right here with no
+// trip through the main loop at all, unless earlier commands are still
+// queued and must be handled first. Credit grants are always taken right
+// here, so that a busy main loop can't hold up its own credit.
+//
+// \return Returns the number of bytes of data processed.
+//*****************************************************************************
+static uint32_t parse_command(tUSBDBulkDevice *device, uint8_t *data, uint32_t nbytes) {
+    uint8_t *cmd;
+    uint32_t idx_read;
+    uint32_t i;
 
-    //for (i = 0; i < bufsize; i++) {
-    //    g_usb_tx_buf[idx_write] = ptr[i];
-    //    idx_write++;
-    //    idx_write = (idx_write == BULK_BUFFER_SIZE) ? 0 : idx_write;
-    //}
+    // Update our receive counter.
+    g_rx_count += nbytes;
 
-    //// We've processed the data in place so now send the processed data
-    //// back to the host.
-    //USBBufferDataWritten(&g_tx_cb_buf, bufsize);
+    if (!g_low_latency) {
+        DEBUG_PRINT("Received %d bytes\n", nbytes);
+    }
 
-    //DEBUG_PRINT("Wrote %d bytes\n", bufsize);
+    // A grant doesn't take a queue slot, so it gets through even when the
+    // queue is full, which is just when the host is likely to be waiting on
+    // the stream.
+    if (data[0] == CMD_GRANT_CREDITS) {
+        cmd = g_grant;
+    }
+    else if (g_command_head - g_command_tail == COMMAND_QUEUE_DEPTH) {
+        DEBUG_PRINT("Command queue full\n");
+        return nbytes;
+    }
+    else {
+        cmd = g_commands[g_command_head % COMMAND_QUEUE_DEPTH];
+    }
+
+    // Copy the command out of the receive buffer, taking care of the buffer
+    // wrap, so the handlers can treat it as a contiguous struct.
+    idx_read = (uint32_t)(data - g_usb_rx_buf);
+    for (i = 0; i < COMMAND_MAX_SIZE; i++) {
+        cmd[i] = (i < nbytes) ? g_usb_rx_buf[idx_read] : 0;
+        idx_read++;
+        idx_read = (idx_read == BULK_BUFFER_SIZE) ? 0 : idx_read;
+    }
+
+    if ((cmd == g_grant) ||
+            ((cmd[0] == CMD_LOOP) && (g_command_head == g_command_tail))) {
+        handle_command(cmd);
+    }
+    else {
+        g_command_head++;
+        sched_signal(EVENT_COMMAND);
+    }
 
-    // We processed as much data as we can directly from the receive buffer so
-    // we need to return the number of bytes to allow the lower layer to
-    // update its read pointer appropriately.
-    return 0; //bufsize;
+    // Each packet holds exactly one command, so the whole packet has been
+    // consumed. Returning the byte count lets the lower layer advance its
+    // read pointer so the next command starts at the front of the data.
+    return nbytes;
 }
 
 //*****************************************************************************
@@ -205,16 +643,30 @@ static uint32_t parse_command(tUSBDBulkDevice *device, uint8_t *data, uint32_t n
 // related to operation of the transmit data channel (the IN channel carrying
 // data to the USB host).
 //
-// In this case, we don't need to do anything in response to the transmit
-// event, so we just increment the transmit counter and output a debug message.
+// We count the bytes sent, and when the buffer has drained right after a
+// full-sized packet we end the transfer with a zero-length packet if the host
+// asked for that. Otherwise a host reading in large blocks would sit waiting
+// for more data, since only a short packet tells it the transfer is over.
 //
 // \return The return value is event-specific.
 //*****************************************************************************
 uint32_t TxHandler(void *data, uint32_t event, uint32_t msgval, void *msgdata) {
+    uint32_t fill;
+
     if (event == USB_EVENT_TX_COMPLETE) {
         g_tx_count += msgval;
+
+        fill = USBBufferDataAvailable(&g_tx_cb_buf) + g_tx_pending;
+        g_tx_fill_min = (fill < g_tx_fill_min) ? fill : g_tx_fill_min;
+
+        if (g_coalesce_zlp && (msgval == BULK_PACKET_SIZE) &&
+                (g_tx_pending == 0) && (USBBufferDataAvailable(&g_tx_cb_buf) == 0)) {
+            USBDBulkPacketWrite(&g_bulk_device, g_usb_tx_buf, 0, true);
+        }
+    }
+    if (!g_low_latency) {
+        DEBUG_PRINT("TX complete %d\n", msgval);
     }
-    DEBUG_PRINT("TX complete %d\n", msgval);
     return(0);
 }
 
@@ -236,11 +688,22 @@ uint32_t TxHandler(void *data, uint32_t event, uint32_t msgval, void *msgdata) {
 uint32_t RxHandler(void *data, uint32_t event, uint32_t msgval, void *msgdata) {
     switch(event) {
         // We are connected to a host and communication is now possible.
+        // The first time, the stored settings are put back and sampling
+        // resumed, with no need to hear from the host.
         case USB_EVENT_CONNECTED: {
+            static bool resumed = false;
+
             g_usb_configured = true;
             UARTprintf("Host connected.\n");
+            g_credits_on = false;
+            g_tx_pending = 0;
             USBBufferFlush(&g_tx_cb_buf);
             USBBufferFlush(&g_rx_cb_buf);
+            if (!resumed) {
+                resumed = true;
+                g_resume = true;
+                sched_signal(EVENT_COMMAND);
+            }
             break;
         }
 
@@ -269,11 +732,6 @@ uint32_t RxHandler(void *data, uint32_t event, uint32_t msgval, void *msgdata) {
     return 0;
 }
 
-void Timer0IntHandler(void) {
-    ROM_TimerIntClear(TIMER0_BASE, TIMER_TIMA_TIMEOUT);
-    g_timer_event = 1;
-}
-
 void config_uart0(void) {
     ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_GPIOA);
     ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_UART0);
@@ -285,6 +743,9 @@ void config_uart0(void) {
     ROM_UARTClockSourceSet(UART0_BASE, UART_CLOCK_PIOSC);
 
     UARTStdioConfig(0, 115200, 16000000);
+
+    // Debug output is the least urgent thing we do.
+    IntPrioritySet(INT_UART0, 0x40);
 }
 
 void config_led(void) {
@@ -295,18 +756,40 @@ void config_led(void) {
     ROM_GPIOPinTypeGPIOOutput(GPIO_PORTF_BASE, GPIO_PIN_3|GPIO_PIN_2);
 }
 
-void config_timer0(void) {
-    SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER0);
-
-    TimerConfigure(TIMER0_BASE, TIMER_CFG_A_PERIODIC);
-    uint32_t cg = SysCtlClockGet();
-    UARTprintf("clock get: %d\n", cg);
-    TimerLoadSet(TIMER0_BASE, TIMER_A, SysCtlClockGet() / 2);
+void config_pwm(void) {
+    // PE4 is M0PWM4, driven by generator 2 of PWM module 0.
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_GPIOE);
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_PWM0);
+    SysCtlPWMClockSet(SYSCTL_PWMDIV_1);
+
+    ROM_GPIOPinConfigure(GPIO_PE4_M0PWM4);
+    ROM_GPIOPinTypePWM(GPIO_PORTE_BASE, GPIO_PIN_4);
+
+    // The period matches the range of the ADC so the loop output and input
+    // share the same 12-bit scale.
+    PWMGenConfigure(PWM0_BASE, PWM_GEN_2, PWM_GEN_MODE_DOWN | PWM_GEN_MODE_NO_SYNC);
+    PWMGenPeriodSet(PWM0_BASE, PWM_GEN_2, LOOP_OUTPUT_MAX + 1);
+    PWMOutputState(PWM0_BASE, PWM_OUT_4_BIT, false);
+    PWMGenEnable(PWM0_BASE, PWM_GEN_2);
+}
 
-    IntMasterEnable();
+void config_adc(void) {
+    // AIN0 is on PE3.
+    ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_GPIOE);
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_ADC0);
+    ROM_GPIOPinTypeADC(GPIO_PORTE_BASE, GPIO_PIN_3);
+
+    // Sequence 3 takes a single sample on demand for the closed loop.
+    ADCSequenceConfigure(ADC0_BASE, 3, ADC_TRIGGER_PROCESSOR, 0);
+    ADCSequenceStepConfigure(ADC0_BASE, 3, 0, ADC_CTL_CH0 | ADC_CTL_IE | ADC_CTL_END);
+    ADCSequenceEnable(ADC0_BASE, 3);
+    ADCIntClear(ADC0_BASE, 3);
+}
 
-    TimerIntEnable(TIMER0_BASE, TIMER_TIMA_TIMEOUT);
-    IntEnable(INT_TIMER0A);
+void config_udma(void) {
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_UDMA);
+    uDMAEnable();
+    uDMAControlBaseSet(g_udma_control);
 }
 
 void config_usb(void) {
@@ -318,6 +801,10 @@ void config_usb(void) {
     USBBufferInit((tUSBBuffer *)&g_tx_cb_buf);
     USBBufferInit((tUSBBuffer *)&g_rx_cb_buf);
 
+    // Closed-loop commands are answered from the USB interrupt, so it must
+    // not wait behind anything else.
+    IntPrioritySet(INT_USB0, 0x00);
+
     // Set the USB stack mode to Device mode with no VBUS monitoring.
     USBStackModeSet(0, eUSBModeForceDevice, 0);
 
@@ -325,74 +812,296 @@ void config_usb(void) {
     USBDBulkInit(0, (tUSBDBulkDevice*)&g_bulk_device);
 }
 
+//*****************************************************************************
+// Task for EVENT_USB_FLUSH: hand held-back transmit data to the USB library
+// once it has been held for the maximum time.
+//*****************************************************************************
+void task_usb_flush(void) {
+    bool masked;
 
-int main(void) {
-    volatile uint32_t idx_loop;
-    uint32_t tx_count = 0;
-    uint32_t rx_count = 0;
-
-    ROM_FPULazyStackingEnable();
+    masked = IntMasterDisable();
+    usb_flush();
+    if (!masked) {
+        IntMasterEnable();
+    }
+}
 
-    // Set the clocking to run from the PLL at 50MHz
-    ROM_SysCtlClockSet(SYSCTL_SYSDIV_4 | SYSCTL_USE_PLL | SYSCTL_OSC_MAIN |
-                       SYSCTL_XTAL_16MHZ);
+//*****************************************************************************
+// Task for EVENT_LOGIC: send the logic-analyzer blocks captured so far.
+//*****************************************************************************
+void task_logic(void) {
+    uint8_t payload[LOGIC_PAYLOAD_MAX];
+    uint32_t timestamp;
+    uint32_t nbytes;
+
+    while ((nbytes = logic_read(payload, &timestamp)) != 0) {
+        if (!frame_send_at(FRAME_LOGIC, timestamp, payload, nbytes)) {
+            g_dropped_samples += LOGIC_BLOCK;
+        }
+    }
+}
 
-    config_uart0();
-    config_led();
+//*****************************************************************************
+// Task for EVENT_SPI: send the SPI sensor blocks received so far.
+//*****************************************************************************
+void task_spi(void) {
+    uint8_t payload[SPI_PAYLOAD_MAX];
+    spi_header_t *header = (spi_header_t*)payload;
+    uint32_t timestamp;
+    uint32_t nbytes;
+
+    while ((nbytes = spi_read(payload, &timestamp)) != 0) {
+        if (!frame_send_at(FRAME_SPI, timestamp, payload, nbytes)) {
+            g_dropped_samples += header->count;
+        }
+    }
+}
 
-    UARTprintf("\033[2JStellaris USB bulk device example\n");
-    UARTprintf("---------------------------------\n\n");
+//*****************************************************************************
+// Feed a block of samples to the spectrum and send it whenever one is
+// finished.
+//
+// \param header points to the FRAME_SAMPLES payload holding the block.
+//
+// The time taken is charged to the windows transformed, for telemetry.
+//*****************************************************************************
+static void spectrum_update(const samples_header_t *header) {
+    const uint16_t *raw = (const uint16_t*)(header + 1);
+    float samples[CHANNELS_BLOCK];
+    uint32_t start;
+    uint32_t windows;
+    uint32_t cycles;
+    uint32_t i;
+
+    for (i = 0; i < header->nsamples; i++) {
+        samples[i] = raw[i];
+    }
 
-    g_usb_configured = false;
+    start = cycles_now();
+    windows = spectrum_add(samples, header->nsamples);
+    if (windows) {
+        cycles = (cycles_now() - start) / windows;
+        g_fft_cycles = (cycles > g_fft_cycles) ? cycles : g_fft_cycles;
+    }
 
+    if (spectrum_read(g_spectrum.bins)) {
+        g_spectrum.header.nfft = SPECTRUM_N;
+        g_spectrum.header.period = header->period;
+        frame_send(FRAME_SPECTRUM, &g_spectrum, sizeof(g_spectrum));
+    }
+}
 
-    // Enable the system tick.
-    ROM_SysTickPeriodSet(ROM_SysCtlClockGet() / SYSTICKS_PER_SECOND);
-    ROM_SysTickIntEnable();
-    ROM_SysTickEnable();
+//*****************************************************************************
+// Send a block of samples as a FRAME_SAMPLES frame, averaged down first if
+// flow control is short of credit, see CMD_GRANT_CREDITS.
+//
+// \param timestamp is the time of the block's first sample.
+// \param payload is the block as from channels_read(), a samples_header_t
+// followed by the samples. The samples may be overwritten.
+// \param nbytes is the payload length.
+//*****************************************************************************
+static void samples_send(uint32_t timestamp, uint8_t *payload, uint32_t nbytes) {
+    samples_header_t *header = (samples_header_t*)payload;
+    uint16_t *samples = (uint16_t*)(header + 1);
+    uint32_t nsamples = header->nsamples;
+    uint32_t factor = g_credit_decimation;
+    uint32_t sum;
+    uint32_t i;
+    uint32_t j;
+
+    if (g_credits_on && (g_credits < g_credit_low_water) && (factor > 1)) {
+        for (i = 0; i < nsamples / factor; i++) {
+            sum = 0;
+            for (j = 0; j < factor; j++) {
+                sum += samples[i * factor + j];
+            }
+            samples[i] = (sum + factor / 2) / factor;
+        }
+        header->nsamples = nsamples / factor;
+        header->period *= factor;
+        nbytes = sizeof(*header) + header->nsamples * sizeof(uint16_t);
+        g_degraded_frames++;
+    }
 
-    // Tell the user what we are up to.
-    UARTprintf("Configuring USB\n");
+    if (!frame_send_at(FRAME_SAMPLES, timestamp, payload, nbytes)) {
+        g_dropped_samples += nsamples;
+    }
+}
 
-    config_usb();
+//*****************************************************************************
+// Fold a sample block into the feature windows, and send the window and
+// decimated samples that completes, if any.
+//
+// \param header is the block as from channels_read(), followed by the
+// samples.
+// \param timestamp is the time of the block's first sample.
+// \param samples is false if the channel's samples are held back, in which
+// case decimated ones are not sent either.
+//*****************************************************************************
+static void envelope_update(const samples_header_t *header, uint32_t timestamp,
+                            bool samples) {
+    uint8_t payload[ENVELOPE_PAYLOAD_MAX];
+    features_t features;
+    uint32_t start;
+    uint32_t nbytes;
 
-    UARTprintf("Waiting for host...\n");
+    envelope_add(header, timestamp);
 
-    config_timer0();
-    while (1) {
-        if (g_timer_event) {
-            g_timer_event = 0;
-            GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_3, GPIO_PIN_3);
-            for(idx_loop = 0; idx_loop < 150000; idx_loop++) {}
+    if (envelope_read(&features, &start)) {
+        frame_send_at(FRAME_FEATURES, start, &features, sizeof(features));
+    }
 
+    nbytes = envelope_read_samples(payload, &start);
+    if (nbytes && samples) {
+        samples_send(start, payload, nbytes);
+    }
+}
 
-            uint32_t idx_write;
-            tUSBRingBufObject tx_buf;
+//*****************************************************************************
+// Task for EVENT_SAMPLE: send the analog sample blocks taken so far.
+//
+// The LED on PF3 is lit while this runs, so its cost can be seen on a scope.
+//*****************************************************************************
+void task_sample(void) {
+    uint8_t payload[CHANNELS_PAYLOAD_MAX];
+    samples_header_t *header = (samples_header_t*)payload;
+    uint32_t timestamp;
+    uint32_t nbytes;
+    bool samples;
+
+    GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_3, GPIO_PIN_3);
+
+    while ((nbytes = channels_read(payload, &timestamp)) != 0) {
+        if (g_boot_cycles == 0) {
+            g_boot_cycles = timestamp;
+        }
 
-            USBBufferInfoGet(&g_tx_cb_buf, &tx_buf);
+        samples = true;
+        if (g_spectrum_on && (header->channel == 0)) {
+            spectrum_update(header);
+            samples = g_spectrum_raw;
+        }
 
-            idx_write = tx_buf.ui32WriteIndex;
+        if (g_features_on) {
+            envelope_update(header, timestamp, samples);
+            samples = samples && (g_features_decimation == 1);
+        }
 
-            float samples[] = {
-                0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0,
-                8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0,
-            };
-            uint32_t bufsize = sizeof(samples);
-            uint8_t *ptr = (uint8_t*)&samples;
-            uint8_t i;
+        if (samples) {
+            samples_send(timestamp, payload, nbytes);
+        }
+    }
 
-            for (i = 0; i < bufsize; i++) {
-                g_usb_tx_buf[idx_write] = ptr[i];
-                idx_write++;
-                idx_write = (idx_write == BULK_BUFFER_SIZE) ? 0 : idx_write;
-            }
+    GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_3, 0);
+}
 
-            // We've processed the data in place so now send the processed data
-            // back to the host.
-            USBBufferDataWritten(&g_tx_cb_buf, bufsize);
+//*****************************************************************************
+// Task for EVENT_COMMAND: carry out the queued commands in order.
+//*****************************************************************************
+void task_command(void) {
+    if (g_resume) {
+        g_resume = false;
+        if (persist_replay(handle_command)) {
+            set_timer(true);
+        }
+    }
 
+    while (g_command_tail != g_command_head) {
+        handle_command(g_commands[g_command_tail % COMMAND_QUEUE_DEPTH]);
+        g_command_tail++;
+    }
+}
 
-            GPIOPinWrite(GPIO_PORTF_BASE, GPIO_PIN_3, 0);
-        }
+//*****************************************************************************
+// Task for EVENT_STATUS_UPDATE: send a telemetry frame covering the time
+// since the previous one.
+//*****************************************************************************
+void send_telemetry(void) {
+    static uint32_t last_cycles = 0;
+    static uint32_t last_overruns = 0;
+    telemetry_t telemetry;
+    uint32_t now;
+    uint32_t idle;
+    bool masked;
+
+    now = cycles_now();
+    idle = sched_idle_cycles();
+    telemetry.latency_max = sched_latency_max();
+    telemetry.fft_cycles = g_fft_cycles;
+    telemetry.boot_cycles = g_boot_cycles;
+    g_fft_cycles = 0;
+
+    masked = IntMasterDisable();
+    telemetry.tx_bytes = g_tx_count;
+    telemetry.rx_bytes = g_rx_count;
+    telemetry.dropped_frames = g_dropped_frames;
+    telemetry.dropped_samples = g_dropped_samples + logic_dropped() * LOGIC_BLOCK +
+        spi_dropped() * SPI_BLOCK + channels_dropped() * CHANNELS_BLOCK;
+    telemetry.tx_fill_min = (g_tx_fill_min > g_tx_fill_max) ? g_tx_fill_max : g_tx_fill_min;
+    telemetry.tx_fill_max = g_tx_fill_max;
+    telemetry.credits = g_credits_on ? g_credits : 0;
+    telemetry.degraded_frames = g_degraded_frames;
+    telemetry.throttled_frames = g_throttled_frames;
+    telemetry.timer_overruns = channels_overruns() - last_overruns;
+    last_overruns = channels_overruns();
+    g_tx_fill_min = BULK_BUFFER_SIZE;
+    g_tx_fill_max = 0;
+    if (!masked) {
+        IntMasterEnable();
     }
+
+    telemetry.idle_permille = (uint16_t)(((uint64_t)idle * 1000) / (now - last_cycles));
+    telemetry.stack_high_water = StackHighWater();
+    last_cycles = now;
+
+    frame_send(FRAME_TELEMETRY, &telemetry, sizeof(telemetry));
+}
+
+int main(void) {
+    ROM_FPULazyStackingEnable();
+
+    // Set the clocking to run from the PLL at 50MHz
+    ROM_SysCtlClockSet(SYSCTL_SYSDIV_4 | SYSCTL_USE_PLL | SYSCTL_OSC_MAIN |
+                       SYSCTL_XTAL_16MHZ);
+
+    g_usb_configured = false;
+
+    // Register the tasks before any interrupt can signal their events.
+    sched_task(EVENT_USB_FLUSH, task_usb_flush);
+    sched_task(EVENT_LOGIC, task_logic);
+    sched_task(EVENT_SPI, task_spi);
+    sched_task(EVENT_SAMPLE, task_sample);
+    sched_task(EVENT_COMMAND, task_command);
+    sched_task(EVENT_STATUS_UPDATE, send_telemetry);
+
+    // Only what the USB interrupt itself uses is set up before USB, so the
+    // host can start enumerating the device as soon as possible. Everything
+    // else, including the banner, is done while that goes on: nothing that
+    // needs it runs before the scheduler starts.
+    config_uart0();
+    config_pwm();
+    config_adc();
+
+    // Enable the system tick.
+    ROM_SysTickPeriodSet(ROM_SysCtlClockGet() / SYSTICKS_PER_SECOND);
+    ROM_SysTickIntEnable();
+    ROM_SysTickEnable();
+
+    config_usb();
+
+    config_led();
+    config_udma();
+    spectrum_init();
+    logic_init(EVENT_LOGIC);
+    spi_init(EVENT_SPI);
+    channels_init(EVENT_SAMPLE);
+    persist_init();
+
+    UARTprintf("\033[2JStellaris USB bulk device example\n");
+    UARTprintf("---------------------------------\n\n");
+    UARTprintf("Waiting for host...\n");
+
+    IntMasterEnable();
+
+    sched_run();
 }
@@ -0,0 +1,176 @@
+//*****************************************************************************
+//
+// persist.c - Acquisition settings kept in the on-chip EEPROM across resets.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driverlib/eeprom.h"
+#include "driverlib/sysctl.h"
+
+#include "persist.h"
+#include "protocol.h"
+
+// marks a valid record; change it whenever the layout changes
+#define PERSIST_MAGIC 0x54445102
+
+// room for the largest command kept
+#define PERSIST_SLOT_SIZE 40
+
+// the commands kept, in the order they are replayed
+static const struct {
+    uint8_t cmd;
+    uint8_t size;
+} g_persist_commands[] = {
+    { CMD_SET_COALESCE, sizeof(coalesce_cmd_t) },
+    { CMD_SET_TELEMETRY, sizeof(telemetry_cmd_t) },
+    { CMD_SET_CHANNELS, sizeof(channels_cmd_t) },
+    { CMD_SET_SPECTRUM, sizeof(spectrum_cmd_t) },
+    { CMD_SET_FEATURES, sizeof(features_cmd_t) },
+    { CMD_SET_LOGIC, sizeof(logic_cmd_t) },
+    { CMD_SET_SPI, sizeof(spi_cmd_t) },
+};
+
+#define PERSIST_COMMANDS (sizeof(g_persist_commands) / sizeof(g_persist_commands[0]))
+
+// the record as laid out from EEPROM address 0; an unused slot starts with 0
+typedef struct {
+    uint32_t magic;
+    uint32_t streaming;
+    uint8_t commands[PERSIST_COMMANDS][PERSIST_SLOT_SIZE];
+} persist_t;
+
+// copy of what the EEPROM holds
+static persist_t g_persist;
+
+//*****************************************************************************
+// Write part of the record from the copy in RAM to the EEPROM.
+//
+// \param field points to the part of g_persist to write, which must be
+// word-aligned.
+// \param nbytes is its length, rounded up to whole words.
+//
+// The record is made valid first if it isn't already, so the rest of it is
+// written out too then.
+//*****************************************************************************
+static void persist_write(void *field, uint32_t nbytes) {
+    uint32_t offset = (uint32_t)((uint8_t*)field - (uint8_t*)&g_persist);
+
+    if (g_persist.magic != PERSIST_MAGIC) {
+        g_persist.magic = PERSIST_MAGIC;
+        field = &g_persist;
+        offset = 0;
+        nbytes = sizeof(g_persist);
+    }
+
+    EEPROMProgram((uint32_t*)field, offset, (nbytes + 3) & ~3);
+}
+
+//*****************************************************************************
+// Bring up the EEPROM and read the stored record. If there isn't a valid one,
+// nothing is replayed until settings have been saved.
+//*****************************************************************************
+void persist_init(void) {
+    uint8_t *bytes = (uint8_t*)&g_persist;
+    uint32_t i;
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_EEPROM0);
+    if (EEPROMInit() == EEPROM_INIT_OK) {
+        EEPROMRead((uint32_t*)&g_persist, 0, sizeof(g_persist));
+    }
+
+    if (g_persist.magic != PERSIST_MAGIC) {
+        for (i = 0; i < sizeof(g_persist); i++) {
+            bytes[i] = 0;
+        }
+    }
+}
+
+//*****************************************************************************
+// Keep a command if it is one that is persisted and differs from the one
+// stored.
+//
+// \param cmd points to the command, COMMAND_MAX_SIZE bytes long.
+//*****************************************************************************
+void persist_save(const uint8_t *cmd) {
+    uint8_t *slot;
+    uint32_t size;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < PERSIST_COMMANDS; i++) {
+        if (g_persist_commands[i].cmd != cmd[0]) {
+            continue;
+        }
+
+        slot = g_persist.commands[i];
+        size = g_persist_commands[i].size;
+        for (j = 0; (j < size) && (slot[j] == cmd[j]); j++) {}
+        if ((j == size) && (g_persist.magic == PERSIST_MAGIC)) {
+            return;
+        }
+
+        for (j = 0; j < size; j++) {
+            slot[j] = cmd[j];
+        }
+        persist_write(slot, size);
+        return;
+    }
+}
+
+//*****************************************************************************
+// Keep whether sampling is on.
+//
+// \param streaming is true if the sample timer is running.
+//*****************************************************************************
+void persist_streaming(bool streaming) {
+    if ((g_persist.streaming != streaming) || (g_persist.magic != PERSIST_MAGIC)) {
+        g_persist.streaming = streaming;
+        persist_write(&g_persist.streaming, sizeof(g_persist.streaming));
+    }
+}
+
+//*****************************************************************************
+// Pass each stored command to a handler, in a fixed order.
+//
+// \param handler is called with each command, padded with zeros to
+// COMMAND_MAX_SIZE bytes.
+//
+// \return Returns true if sampling was on when the settings were last saved.
+//*****************************************************************************
+bool persist_replay(persist_handler_t handler) {
+    uint8_t cmd[COMMAND_MAX_SIZE];
+    uint32_t i;
+    uint32_t j;
+
+    if (g_persist.magic != PERSIST_MAGIC) {
+        return false;
+    }
+
+    for (i = 0; i < PERSIST_COMMANDS; i++) {
+        if (g_persist.commands[i][0] != g_persist_commands[i].cmd) {
+            continue;
+        }
+
+        for (j = 0; j < COMMAND_MAX_SIZE; j++) {
+            cmd[j] = (j < PERSIST_SLOT_SIZE) ? g_persist.commands[i][j] : 0;
+        }
+        handler(cmd);
+    }
+
+    return g_persist.streaming != 0;
+}
+
+//*****************************************************************************
+// Forget the stored settings. The ones in effect are left alone.
+//*****************************************************************************
+void persist_clear(void) {
+    uint8_t *bytes = (uint8_t*)&g_persist;
+    uint32_t i;
+
+    for (i = 0; i < sizeof(g_persist); i++) {
+        bytes[i] = 0;
+    }
+    EEPROMProgram(&g_persist.magic, 0, sizeof(g_persist.magic));
+}
@@ -0,0 +1,148 @@
+//*****************************************************************************
+//
+// sched.c - Event-driven cooperative task scheduler.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driverlib/cpu.h"
+#include "driverlib/interrupt.h"
+
+#include "cycles.h"
+#include "sched.h"
+
+// task to run for each event
+static sched_task_t g_tasks[SCHED_MAX_TASKS];
+
+// pending events, one bit per event
+static volatile uint32_t g_events = 0;
+
+// time each pending event was first signalled
+static uint32_t g_signal_time[SCHED_MAX_TASKS];
+
+// time spent asleep and the longest wait from an event to its task, since
+// these were last read
+static volatile uint32_t g_idle_cycles = 0;
+static volatile uint32_t g_latency_max = 0;
+
+//*****************************************************************************
+// Register the task to run for an event.
+//
+// \param event is the event number, which is also the task's priority (0 is
+// the highest).
+// \param task is the function to call each time the event is handled.
+//*****************************************************************************
+void sched_task(uint32_t event, sched_task_t task) {
+    g_tasks[event] = task;
+}
+
+//*****************************************************************************
+// Mark an event as pending so its task runs from the main loop.
+//
+// \param event is the event number.
+//
+// This may be called from any interrupt handler or from a task. Signalling
+// an event that is already pending does nothing, so the task runs once for
+// any number of signals in between.
+//
+// \return Returns false if the event was already pending.
+//*****************************************************************************
+bool sched_signal(uint32_t event) {
+    uint32_t bit = 1u << event;
+    bool pending;
+    bool masked;
+
+    masked = IntMasterDisable();
+    pending = (g_events & bit) != 0;
+    if (!pending) {
+        g_signal_time[event] = cycles_now();
+        g_events |= bit;
+    }
+    if (!masked) {
+        IntMasterEnable();
+    }
+
+    return !pending;
+}
+
+//*****************************************************************************
+// Run tasks as their events are signalled. This never returns.
+//
+// After each task the pending events are looked at afresh, so a
+// higher-priority event signalled while a task runs is handled next.
+//
+// When nothing is pending the core sleeps. Interrupts are masked across the
+// check and the WFI: a pending interrupt still wakes the core, but its
+// handler only runs once they are unmasked again, so an event signalled just
+// after the check can't be slept through, and the time the handler takes is
+// not counted as idle.
+//*****************************************************************************
+void sched_run(void) {
+    uint32_t pending;
+    uint32_t event;
+    uint32_t start;
+    uint32_t latency;
+
+    while (1) {
+        IntMasterDisable();
+        pending = g_events;
+
+        if (!pending) {
+            start = cycles_now();
+            CPUwfi();
+            g_idle_cycles += cycles_now() - start;
+            IntMasterEnable();
+            continue;
+        }
+
+        event = __builtin_ctz(pending);
+        g_events = pending & ~(1u << event);
+        latency = cycles_now() - g_signal_time[event];
+        g_latency_max = (latency > g_latency_max) ? latency : g_latency_max;
+        IntMasterEnable();
+
+        if (g_tasks[event]) {
+            g_tasks[event]();
+        }
+    }
+}
+
+//*****************************************************************************
+// Read and reset the time spent asleep.
+//
+// \return Returns the cycles spent in WFI since the last call.
+//*****************************************************************************
+uint32_t sched_idle_cycles(void) {
+    uint32_t idle;
+    bool masked;
+
+    masked = IntMasterDisable();
+    idle = g_idle_cycles;
+    g_idle_cycles = 0;
+    if (!masked) {
+        IntMasterEnable();
+    }
+
+    return idle;
+}
+
+//*****************************************************************************
+// Read and reset the worst-case scheduling latency.
+//
+// \return Returns the longest time, in cycles, from an event being signalled
+// to its task starting, since the last call.
+//*****************************************************************************
+uint32_t sched_latency_max(void) {
+    uint32_t latency;
+    bool masked;
+
+    masked = IntMasterDisable();
+    latency = g_latency_max;
+    g_latency_max = 0;
+    if (!masked) {
+        IntMasterEnable();
+    }
+
+    return latency;
+}
@@ -0,0 +1,234 @@
+//*****************************************************************************
+//
+// spectrum.c - Averaged magnitude spectra of the sample stream.
+//
+// The SPECTRUM_N real samples of a window are packed into SPECTRUM_N / 2
+// complex values (even samples in the real part, odd in the imaginary),
+// transformed with an iterative radix-2 FFT, and then split into the
+// spectrum of the real input. That halves the work of a complex FFT of the
+// full length.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "protocol.h"
+#include "spectrum.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define SPECTRUM_M (SPECTRUM_N / 2)
+#define SPECTRUM_LOG2_M 7
+
+// cos and sin of 2 pi k / SPECTRUM_N for k up to SPECTRUM_M
+static float g_cos[SPECTRUM_M + 1];
+static float g_sin[SPECTRUM_M + 1];
+
+static float g_window[SPECTRUM_N];
+static uint8_t g_bitrev[SPECTRUM_M];
+
+// samples waiting to be transformed; the last half of each window is kept
+// as the first half of the next
+static float g_input[SPECTRUM_N];
+static uint32_t g_fill = 0;
+
+static float g_re[SPECTRUM_M];
+static float g_im[SPECTRUM_M];
+
+// power summed over the windows so far, and the finished spectrum
+static float g_power[SPECTRUM_BINS];
+static float g_bins[SPECTRUM_BINS];
+static uint16_t g_averages = 0;
+static uint16_t g_count = 0;
+static bool g_ready = false;
+
+//*****************************************************************************
+// Build the twiddle, window and bit-reversal tables.
+//*****************************************************************************
+void spectrum_init(void) {
+    uint32_t i;
+    uint32_t b;
+    uint32_t r;
+
+    for (i = 0; i <= SPECTRUM_M; i++) {
+        g_cos[i] = cosf(2.0f * (float)M_PI * i / SPECTRUM_N);
+        g_sin[i] = sinf(2.0f * (float)M_PI * i / SPECTRUM_N);
+    }
+
+    // The periodic form of the Hann window, so that overlapping by half
+    // weights every sample equally.
+    for (i = 0; i < SPECTRUM_N; i++) {
+        g_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / SPECTRUM_N);
+    }
+
+    for (i = 0; i < SPECTRUM_M; i++) {
+        for (b = 0, r = 0; b < SPECTRUM_LOG2_M; b++) {
+            r |= ((i >> b) & 1) << (SPECTRUM_LOG2_M - 1 - b);
+        }
+        g_bitrev[i] = r;
+    }
+}
+
+//*****************************************************************************
+// Start over with a new averaging count.
+//
+// \param averages is the number of windows per spectrum, or 0 to stop.
+//*****************************************************************************
+void spectrum_config(uint16_t averages) {
+    uint32_t k;
+
+    g_averages = averages;
+    g_count = 0;
+    g_fill = 0;
+    g_ready = false;
+    for (k = 0; k < SPECTRUM_BINS; k++) {
+        g_power[k] = 0.0f;
+    }
+}
+
+//*****************************************************************************
+// Transform the window in g_input and add its power to g_power.
+//*****************************************************************************
+static void spectrum_window(void) {
+    uint32_t len;
+    uint32_t half;
+    uint32_t step;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+    uint32_t a;
+    uint32_t b;
+    float c;
+    float s;
+    float tr;
+    float ti;
+
+    // Window, pack pairs of real samples into complex values and put them
+    // in bit-reversed order, all in one pass.
+    for (i = 0; i < SPECTRUM_M; i++) {
+        j = g_bitrev[i];
+        g_re[j] = g_input[2 * i] * g_window[2 * i];
+        g_im[j] = g_input[2 * i + 1] * g_window[2 * i + 1];
+    }
+
+    // Radix-2 decimation-in-time butterflies. The twiddle for a butterfly
+    // span of len is exp(-2 pi i j / len), found in the SPECTRUM_N table.
+    for (len = 2; len <= SPECTRUM_M; len <<= 1) {
+        half = len / 2;
+        step = SPECTRUM_N / len;
+        for (i = 0; i < SPECTRUM_M; i += len) {
+            for (j = 0; j < half; j++) {
+                c = g_cos[j * step];
+                s = g_sin[j * step];
+                a = i + j;
+                b = a + half;
+                tr = g_re[b] * c + g_im[b] * s;
+                ti = g_im[b] * c - g_re[b] * s;
+                g_re[b] = g_re[a] - tr;
+                g_im[b] = g_im[a] - ti;
+                g_re[a] += tr;
+                g_im[a] += ti;
+            }
+        }
+    }
+
+    // Split into the spectrum of the real input: with Z the transform of the
+    // packed values, the even and odd samples transform to
+    // E = (Z[k] + conj(Z[M-k])) / 2 and O = (Z[k] - conj(Z[M-k])) / 2i, and
+    // X[k] = E + exp(-2 pi i k / N) O.
+    for (k = 0; k <= SPECTRUM_M; k++) {
+        uint32_t p = k % SPECTRUM_M;
+        uint32_t q = (SPECTRUM_M - k) % SPECTRUM_M;
+        float er = 0.5f * (g_re[p] + g_re[q]);
+        float ei = 0.5f * (g_im[p] - g_im[q]);
+        float odr = 0.5f * (g_im[p] + g_im[q]);
+        float odi = -0.5f * (g_re[p] - g_re[q]);
+        float xr;
+        float xi;
+
+        c = g_cos[k];
+        s = g_sin[k];
+        xr = er + odr * c + odi * s;
+        xi = ei + odi * c - odr * s;
+        g_power[k] += xr * xr + xi * xi;
+    }
+}
+
+//*****************************************************************************
+// Add samples to the spectrum.
+//
+// \param samples points to the new samples.
+// \param nsamples is the number of samples.
+//
+// A window is transformed each time SPECTRUM_N / 2 new samples have come in,
+// so this may do anything from none to several. Once the averaging count is
+// reached, the spectrum is finished and spectrum_read() returns it; if it
+// hasn't been read by the time the next one is finished, it is replaced.
+//
+// \return Returns the number of windows transformed.
+//*****************************************************************************
+uint32_t spectrum_add(const float *samples, uint32_t nsamples) {
+    uint32_t windows = 0;
+    uint32_t i;
+    uint32_t k;
+    float scale;
+
+    if (g_averages == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < nsamples; i++) {
+        g_input[g_fill++] = samples[i];
+        if (g_fill < SPECTRUM_N) {
+            continue;
+        }
+
+        spectrum_window();
+        windows++;
+        for (k = 0; k < SPECTRUM_M; k++) {
+            g_input[k] = g_input[k + SPECTRUM_M];
+        }
+        g_fill = SPECTRUM_M;
+
+        if (++g_count == g_averages) {
+            // The Hann window sums to N / 2, and all bins but DC and
+            // Nyquist hold half the energy of their sine.
+            for (k = 0; k < SPECTRUM_BINS; k++) {
+                scale = ((k == 0) || (k == SPECTRUM_M)) ? 1.0f : 2.0f;
+                g_bins[k] = sqrtf(g_power[k] / g_count) * scale / SPECTRUM_M;
+                g_power[k] = 0.0f;
+            }
+            g_count = 0;
+            g_ready = true;
+        }
+    }
+
+    return windows;
+}
+
+//*****************************************************************************
+// Take the finished spectrum, if there is one.
+//
+// \param bins points to room for SPECTRUM_BINS magnitudes.
+//
+// \return Returns the number of bins written, or 0 if no spectrum has been
+// finished since the last call.
+//*****************************************************************************
+uint32_t spectrum_read(float *bins) {
+    uint32_t k;
+
+    if (!g_ready) {
+        return 0;
+    }
+
+    for (k = 0; k < SPECTRUM_BINS; k++) {
+        bins[k] = g_bins[k];
+    }
+    g_ready = false;
+
+    return SPECTRUM_BINS;
+}
@@ -0,0 +1,328 @@
+//*****************************************************************************
+//
+// spi.c - Timer-triggered SPI sensor acquisition on SSI0.
+//
+//*****************************************************************************
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "inc/hw_ints.h"
+#include "inc/hw_memmap.h"
+#include "inc/hw_ssi.h"
+#include "inc/hw_types.h"
+#include "driverlib/gpio.h"
+#include "driverlib/interrupt.h"
+#include "driverlib/pin_map.h"
+#include "driverlib/ssi.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/timer.h"
+#include "driverlib/udma.h"
+
+#include "cycles.h"
+#include "protocol.h"
+#include "sched.h"
+#include "spi.h"
+
+// the two halves of a ping-pong transfer
+static const uint32_t g_spi_select[2] = { UDMA_PRI_SELECT, UDMA_ALT_SELECT };
+
+// SSI frame formats and uDMA arbitration sizes, indexed by SPI mode and by
+// log2 of the transaction length
+static const uint32_t g_spi_protocol[4] = {
+    SSI_FRF_MOTO_MODE_0, SSI_FRF_MOTO_MODE_1,
+    SSI_FRF_MOTO_MODE_2, SSI_FRF_MOTO_MODE_3,
+};
+static const uint32_t g_spi_arb[4] = {
+    UDMA_ARB_1, UDMA_ARB_2, UDMA_ARB_4, UDMA_ARB_8,
+};
+
+// the transmit pattern repeated for a whole block, and the receive buffers
+static uint8_t g_spi_tx[SPI_BLOCK * SPI_MAX_XFER];
+static uint8_t g_spi_rx[2][SPI_BLOCK * SPI_MAX_XFER];
+
+// bit per receive half that has been filled and not yet read, the block
+// number each half holds, and the number of the next block to complete
+static volatile uint32_t g_spi_ready = 0;
+static volatile uint32_t g_spi_block[2];
+static volatile uint32_t g_spi_next_block = 0;
+
+// receive half that completes next
+static uint32_t g_spi_half = 0;
+
+// blocks lost because they weren't read in time
+static volatile uint32_t g_spi_dropped = 0;
+
+static uint32_t g_spi_event;
+static uint32_t g_spi_nbytes;
+static uint32_t g_spi_period;
+static uint32_t g_spi_start;
+
+//*****************************************************************************
+// Set up SSI0, Timer 2A and the uDMA channels. Acquisition is left stopped.
+//
+// \param event is the scheduler event to signal when a block is ready.
+//*****************************************************************************
+void spi_init(uint32_t event) {
+    g_spi_event = event;
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_GPIOA);
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_SSI0);
+    GPIOPinConfigure(GPIO_PA2_SSI0CLK);
+    GPIOPinConfigure(GPIO_PA3_SSI0FSS);
+    GPIOPinConfigure(GPIO_PA4_SSI0RX);
+    GPIOPinConfigure(GPIO_PA5_SSI0TX);
+    GPIOPinTypeSSI(GPIO_PORTA_BASE, GPIO_PIN_2 | GPIO_PIN_3 | GPIO_PIN_4 | GPIO_PIN_5);
+
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_TIMER2);
+    TimerConfigure(TIMER2_BASE, TIMER_CFG_PERIODIC);
+
+    // Timer timeouts feed the transmit FIFO; the SSI's own receive requests
+    // empty the receive FIFO.
+    uDMAChannelAssign(UDMA_CH4_TIMER2A);
+    uDMAChannelAssign(UDMA_CH10_SSI0RX);
+    uDMAChannelAttributeDisable(UDMA_CHANNEL_TMR2A,
+                                UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST |
+                                UDMA_ATTR_HIGH_PRIORITY | UDMA_ATTR_REQMASK);
+    uDMAChannelAttributeDisable(UDMA_CHANNEL_SSI0RX,
+                                UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST |
+                                UDMA_ATTR_REQMASK);
+    uDMAChannelAttributeEnable(UDMA_CHANNEL_SSI0RX, UDMA_ATTR_HIGH_PRIORITY);
+    uDMAChannelControlSet(UDMA_CHANNEL_SSI0RX | UDMA_PRI_SELECT,
+                          UDMA_SIZE_8 | UDMA_SRC_INC_NONE | UDMA_DST_INC_8 |
+                          UDMA_ARB_4);
+    uDMAChannelControlSet(UDMA_CHANNEL_SSI0RX | UDMA_ALT_SELECT,
+                          UDMA_SIZE_8 | UDMA_SRC_INC_NONE | UDMA_DST_INC_8 |
+                          UDMA_ARB_4);
+
+    // Completions on both channels are at block rate, like the logic
+    // analyzer's.
+    TimerIntEnable(TIMER2_BASE, TIMER_TIMA_DMA);
+    IntPrioritySet(INT_TIMER2A, 0x20);
+    IntEnable(INT_TIMER2A);
+    IntPrioritySet(INT_SSI0, 0x20);
+    IntEnable(INT_SSI0);
+}
+
+//*****************************************************************************
+// Arm one half of the transmit channel with the whole block pattern.
+//*****************************************************************************
+static void spi_tx_arm(uint32_t half) {
+    uDMAChannelTransferSet(UDMA_CHANNEL_TMR2A | g_spi_select[half],
+                           UDMA_MODE_PINGPONG, g_spi_tx,
+                           (void*)(SSI0_BASE + SSI_O_DR),
+                           SPI_BLOCK * g_spi_nbytes);
+}
+
+//*****************************************************************************
+// Arm one half of the receive channel with its buffer.
+//*****************************************************************************
+static void spi_rx_arm(uint32_t half) {
+    uDMAChannelTransferSet(UDMA_CHANNEL_SSI0RX | g_spi_select[half],
+                           UDMA_MODE_PINGPONG, (void*)(SSI0_BASE + SSI_O_DR),
+                           g_spi_rx[half], SPI_BLOCK * g_spi_nbytes);
+}
+
+//*****************************************************************************
+// Check that a transaction can be run.
+//
+// \param config is the CMD_SET_SPI command giving the transaction.
+//
+// \return Returns false if the transaction length, SPI mode or bit rate isn't
+// supported.
+//*****************************************************************************
+bool spi_valid(const spi_cmd_t *config) {
+    uint32_t nbytes = config->nbytes;
+
+    return (nbytes != 0) && (nbytes <= SPI_MAX_XFER) &&
+        !(nbytes & (nbytes - 1)) && (config->mode <= 3) &&
+        (config->bit_rate >= SPI_MIN_BIT_RATE) &&
+        (config->bit_rate <= SysCtlClockGet() / 2);
+}
+
+//*****************************************************************************
+// Start acquisition.
+//
+// \param config is the CMD_SET_SPI command giving the transaction.
+// \param period is the time between transactions in system clock cycles. It
+// is stretched if needed so each transaction finishes before the next.
+//
+// \return Returns false, and leaves acquisition stopped, if the transaction
+// length, SPI mode or bit rate isn't supported.
+//*****************************************************************************
+bool spi_start(const spi_cmd_t *config, uint32_t period) {
+    uint32_t nbytes = config->nbytes;
+    uint32_t clock = SysCtlClockGet();
+    uint32_t xfer;
+    uint32_t i;
+    uint32_t data;
+    bool masked;
+
+    if (!spi_valid(config)) {
+        return false;
+    }
+
+    // Each byte takes 8 SPI clocks, plus one for the gap between frames.
+    xfer = (clock / config->bit_rate) * (nbytes * 9);
+    period = (period < xfer) ? xfer : period;
+
+    g_spi_nbytes = nbytes;
+    g_spi_period = period;
+    g_spi_ready = 0;
+    g_spi_next_block = 0;
+    g_spi_half = 0;
+
+    for (i = 0; i < SPI_BLOCK * nbytes; i++) {
+        g_spi_tx[i] = config->tx[i % nbytes];
+    }
+
+    SSIConfigSetExpClk(SSI0_BASE, clock, g_spi_protocol[config->mode],
+                       SSI_MODE_MASTER, config->bit_rate, 8);
+    SSIEnable(SSI0_BASE);
+    while (SSIDataGetNonBlocking(SSI0_BASE, &data)) {}
+    SSIDMAEnable(SSI0_BASE, SSI_DMA_RX);
+
+    uDMAChannelControlSet(UDMA_CHANNEL_TMR2A | UDMA_PRI_SELECT,
+                          UDMA_SIZE_8 | UDMA_SRC_INC_8 | UDMA_DST_INC_NONE |
+                          g_spi_arb[__builtin_ctz(nbytes)]);
+    uDMAChannelControlSet(UDMA_CHANNEL_TMR2A | UDMA_ALT_SELECT,
+                          UDMA_SIZE_8 | UDMA_SRC_INC_8 | UDMA_DST_INC_NONE |
+                          g_spi_arb[__builtin_ctz(nbytes)]);
+    spi_tx_arm(0);
+    spi_tx_arm(1);
+    spi_rx_arm(0);
+    spi_rx_arm(1);
+    uDMAChannelEnable(UDMA_CHANNEL_SSI0RX);
+    uDMAChannelEnable(UDMA_CHANNEL_TMR2A);
+
+    TimerLoadSet(TIMER2_BASE, TIMER_A, period - 1);
+
+    // The first transaction starts one period after the timer does.
+    masked = IntMasterDisable();
+    g_spi_start = cycles_now();
+    TimerEnable(TIMER2_BASE, TIMER_A);
+    if (!masked) {
+        IntMasterEnable();
+    }
+
+    return true;
+}
+
+//*****************************************************************************
+// Stop acquisition. Any block not yet read is discarded.
+//*****************************************************************************
+void spi_stop(void) {
+    TimerDisable(TIMER2_BASE, TIMER_A);
+    uDMAChannelDisable(UDMA_CHANNEL_TMR2A);
+    uDMAChannelDisable(UDMA_CHANNEL_SSI0RX);
+    SSIDMADisable(SSI0_BASE, SSI_DMA_RX);
+    SSIDisable(SSI0_BASE);
+    g_spi_ready = 0;
+}
+
+//*****************************************************************************
+// Interrupt handler for Timer 2A, which fires when the uDMA has sent a whole
+// block of transactions from one half of the transmit ping-pong. Both halves
+// send the same pattern, so the finished one is simply set up again.
+//*****************************************************************************
+void Timer2IntHandler(void) {
+    uint32_t half;
+
+    TimerIntClear(TIMER2_BASE, TIMER_TIMA_DMA);
+
+    for (half = 0; half < 2; half++) {
+        if (uDMAChannelModeGet(UDMA_CHANNEL_TMR2A | g_spi_select[half]) ==
+                UDMA_MODE_STOP) {
+            spi_tx_arm(half);
+        }
+    }
+}
+
+//*****************************************************************************
+// Interrupt handler for SSI0, which fires when the uDMA has filled one half
+// of the receive ping-pong.
+//*****************************************************************************
+void SSI0IntHandler(void) {
+    uint32_t half = g_spi_half;
+
+    SSIIntClear(SSI0_BASE, SSIIntStatus(SSI0_BASE, true));
+
+    if (uDMAChannelModeGet(UDMA_CHANNEL_SSI0RX | g_spi_select[half]) !=
+            UDMA_MODE_STOP) {
+        return;
+    }
+
+    if (g_spi_ready & (1 << half)) {
+        g_spi_dropped++;
+    }
+    g_spi_block[half] = g_spi_next_block++;
+    g_spi_ready |= 1 << half;
+
+    spi_rx_arm(half);
+    g_spi_half = half ^ 1;
+
+    sched_signal(g_spi_event);
+}
+
+//*****************************************************************************
+// Copy the oldest received block into a FRAME_SPI payload.
+//
+// \param payload points to room for SPI_PAYLOAD_MAX bytes.
+// \param timestamp is set to the start of the first transaction in the
+// block.
+//
+// The uDMA starts refilling a buffer as soon as the other one is full, so a
+// block that was still being copied by then is thrown away and counted as
+// dropped, and the next one is tried.
+//
+// \return Returns the payload length, or 0 if no block is ready.
+//*****************************************************************************
+uint32_t spi_read(uint8_t *payload, uint32_t *timestamp) {
+    spi_header_t *header = (spi_header_t*)payload;
+    uint8_t *data = payload + sizeof(*header);
+    uint32_t nbytes = SPI_BLOCK * g_spi_nbytes;
+    uint32_t half;
+    uint32_t block;
+    uint32_t i;
+    bool masked;
+
+    while (g_spi_ready) {
+        masked = IntMasterDisable();
+        if (g_spi_ready == 3) {
+            half = ((int32_t)(g_spi_block[1] - g_spi_block[0]) < 0) ? 1 : 0;
+        }
+        else {
+            half = (g_spi_ready == 2) ? 1 : 0;
+        }
+        g_spi_ready &= ~(1 << half);
+        block = g_spi_block[half];
+        if (!masked) {
+            IntMasterEnable();
+        }
+
+        for (i = 0; i < nbytes; i++) {
+            data[i] = g_spi_rx[half][i];
+        }
+
+        if (g_spi_next_block - block >= 2) {
+            g_spi_dropped++;
+            continue;
+        }
+
+        header->nbytes = g_spi_nbytes;
+        header->count = SPI_BLOCK;
+        header->reserved = 0;
+        header->period = g_spi_period;
+        header->block = block;
+        *timestamp = g_spi_start + g_spi_period * (1 + block * SPI_BLOCK);
+        return sizeof(*header) + nbytes;
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+// \return Returns the number of blocks lost since reset.
+//*****************************************************************************
+uint32_t spi_dropped(void) {
+    return g_spi_dropped;
+}
@@ -25,6 +25,8 @@
 #include <stdint.h>
 #include "inc/hw_nvic.h"
 #include "inc/hw_types.h"
+#include "cycles.h"
+#include "stack.h"
 
 //*****************************************************************************
 //
@@ -44,7 +46,10 @@ static void IntDefaultHandler(void);
 extern void SysTickIntHandler(void);
 extern void UARTStdioIntHandler(void);
 extern void USB0DeviceIntHandler(void);
-extern void Timer0IntHandler(void);
+extern void ADC0SS0IntHandler(void);
+extern void Timer1IntHandler(void);
+extern void Timer2IntHandler(void);
+extern void SSI0IntHandler(void);
 
 //*****************************************************************************
 //
@@ -55,10 +60,18 @@ extern int main(void);
 
 //*****************************************************************************
 //
-// Reserve space for the system stack.
+// Reserve space for the system stack.  The size can be overridden from the
+// Makefile once "make stack" and StackHighWater() show what is really needed.
+// The worst case found is about 1700 bytes: 650 for the thread (the sample
+// task sending a block), plus the deepest handler at each of the three
+// interrupt priority levels nesting on top, about 550 for USB, 350 for the
+// ADC and 150 for the UART.  2 KiB leaves some margin over that.
 //
 //*****************************************************************************
-static uint32_t pui32Stack[256];
+#ifndef STACK_SIZE_WORDS
+#define STACK_SIZE_WORDS 512
+#endif
+static uint32_t pui32Stack[STACK_SIZE_WORDS];
 
 //*****************************************************************************
 //
@@ -93,23 +106,23 @@ void (* const g_pfnVectors[])(void) =
     IntDefaultHandler,                      // GPIO Port E
     UARTStdioIntHandler,                    // UART0 Rx and Tx
     IntDefaultHandler,                      // UART1 Rx and Tx
-    IntDefaultHandler,                      // SSI0 Rx and Tx
+    SSI0IntHandler,                         // SSI0 Rx and Tx
     IntDefaultHandler,                      // I2C0 Master and Slave
     IntDefaultHandler,                      // PWM Fault
     IntDefaultHandler,                      // PWM Generator 0
     IntDefaultHandler,                      // PWM Generator 1
     IntDefaultHandler,                      // PWM Generator 2
     IntDefaultHandler,                      // Quadrature Encoder 0
-    IntDefaultHandler,                      // ADC Sequence 0
+    ADC0SS0IntHandler,                      // ADC Sequence 0
     IntDefaultHandler,                      // ADC Sequence 1
     IntDefaultHandler,                      // ADC Sequence 2
     IntDefaultHandler,                      // ADC Sequence 3
     IntDefaultHandler,                      // Watchdog timer
-    Timer0IntHandler,                       // Timer 0 subtimer A
+    IntDefaultHandler,                      // Timer 0 subtimer A
     IntDefaultHandler,                      // Timer 0 subtimer B
-    IntDefaultHandler,                      // Timer 1 subtimer A
+    Timer1IntHandler,                       // Timer 1 subtimer A
     IntDefaultHandler,                      // Timer 1 subtimer B
-    IntDefaultHandler,                      // Timer 2 subtimer A
+    Timer2IntHandler,                       // Timer 2 subtimer A
     IntDefaultHandler,                      // Timer 2 subtimer B
     IntDefaultHandler,                      // Analog Comparator 0
     IntDefaultHandler,                      // Analog Comparator 1
@@ -253,7 +266,12 @@ extern uint32_t _ebss;
 void
 ResetISR(void)
 {
-    uint32_t *pui32Src, *pui32Dest;
+    uint32_t *pui32Src, *pui32Dest, *pui32SP;
+
+    //
+    // Start the cycle counter, so that boot time is measured from reset.
+    //
+    cycles_init();
 
     //
     // Copy the data segment initializers from flash to SRAM.
@@ -277,6 +295,17 @@ ResetISR(void)
           "        strlt   r2, [r0], #4\n"
           "        blt     zero_loop");
 
+    //
+    // Paint the unused part of the stack so that StackHighWater() can find
+    // the deepest point reached later on.  Everything below the current stack
+    // pointer is free at this point.
+    //
+    __asm volatile("    mov     %0, sp\n" : "=r" (pui32SP));
+    for(pui32Dest = pui32Stack; pui32Dest < pui32SP; )
+    {
+        *pui32Dest++ = STACK_PAINT;
+    }
+
     //
     // Enable the floating-point unit.  This must be done here to handle the
     // case where main() uses floating-point and the function prologue saves
@@ -297,6 +326,40 @@ ResetISR(void)
     main();
 }
 
+//*****************************************************************************
+//
+// Returns the size of the system stack in bytes.
+//
+//*****************************************************************************
+uint32_t
+StackSize(void)
+{
+    return(sizeof(pui32Stack));
+}
+
+//*****************************************************************************
+//
+// Returns the deepest stack usage seen since reset in bytes.  The stack grows
+// down, so the first word from the bottom that no longer holds the paint
+// pattern marks the high-water mark.
+//
+//*****************************************************************************
+uint32_t
+StackHighWater(void)
+{
+    uint32_t ui32Idx;
+
+    for(ui32Idx = 0; ui32Idx < STACK_SIZE_WORDS; ui32Idx++)
+    {
+        if(pui32Stack[ui32Idx] != STACK_PAINT)
+        {
+            break;
+        }
+    }
+
+    return((STACK_SIZE_WORDS - ui32Idx) * sizeof(uint32_t));
+}
+
 //*****************************************************************************
 //
 // This is the code that gets called when the processor receives a NMI.  This
@@ -0,0 +1,234 @@
+"""Worst-case stack depth of the firmware image, per interrupt handler.
+
+Usage: python3 stack_usage.py <disassembly> <su-dir>
+
+The disassembly is the output of ``objdump -d -s`` on the linked image and
+<su-dir> holds the ``.su`` files written by gcc's ``-fstack-usage``. ``make
+stack`` produces both and runs this script.
+
+Frame sizes come from the ``.su`` files where available (our own sources) and
+are otherwise estimated from each function's prologue (``push``, ``vpush`` and
+``sub sp``), which covers the prebuilt driverlib and usblib code. The call
+graph is read from the disassembly. Indirect calls (the USB library calls back
+into the application through function pointers) are assumed to reach any
+function whose address is stored somewhere in the image, which may
+over-estimate but never under-estimates.
+"""
+
+import collections
+import glob
+import os
+import re
+import sys
+
+# Bytes pushed by the hardware on exception entry. With the FPU enabled and
+# lazy stacking, the extended frame (registers plus S0-S15 and FPSCR) is
+# reserved whenever the interrupted code was using floating point.
+EXCEPTION_FRAME = 104
+
+# Interrupt priorities as set by the firmware (lower is more urgent). Only a
+# handler of a more urgent level can preempt another, so at most one handler
+# per level is on the stack at once. Handlers not listed are assumed to have
+# a level of their own.
+PRIORITIES = {
+    'USB0DeviceIntHandler': 0x00,
+    'SysTickIntHandler': 0x00,
+    'ADC0SS0IntHandler': 0x20,
+    'Timer1IntHandler': 0x20,
+    'Timer2IntHandler': 0x20,
+    'SSI0IntHandler': 0x20,
+    'UARTStdioIntHandler': 0x40,
+}
+
+FUNC_RE = re.compile(r'^([0-9a-f]+) <([^>]+)>:$')
+INSN_RE = re.compile(r'^\s+([0-9a-f]+):\t[0-9a-f ]+\t(\S+)\s*(.*)$')
+TARGET_RE = re.compile(r'<([^>+]+)(\+0x[0-9a-f]+)?>')
+DATA_RE = re.compile(r'^ ([0-9a-f]+) ((?:[0-9a-f]{2,8} ?){1,4})')
+
+
+def reg_count(reglist):
+    """Number of registers in an objdump register list like {r4-r7, lr}."""
+    count = 0
+    for reg in reglist.strip('{} ').split(','):
+        reg = reg.strip()
+        if '-' in reg:
+            lo, hi = reg.split('-')
+            count += int(hi[1:]) - int(lo[1:]) + 1
+        elif reg:
+            count += 1
+    return count
+
+
+class Function(object):
+
+    def __init__(self, name, addr):
+        self.name = name
+        self.addr = addr
+        self.frame = 0
+        self.calls = set()
+        self.indirect = False
+        self.words = []
+
+
+def parse_disassembly(path):
+    funcs = collections.OrderedDict()
+    data_words = []
+    func = None
+    section = None
+
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip('\n')
+
+            if line.startswith('Contents of section '):
+                section = line.split()[-1].rstrip(':')
+                func = None
+                continue
+            if line.startswith('Disassembly of section '):
+                section = None
+                continue
+
+            if section == '.data':
+                m = DATA_RE.match(line)
+                if m:
+                    for group in m.group(2).split():
+                        if len(group) == 8:
+                            data_words.append(int(''.join(
+                                reversed([group[i:i+2]
+                                          for i in range(0, 8, 2)])), 16))
+                continue
+
+            m = FUNC_RE.match(line)
+            if m:
+                func = Function(m.group(2), int(m.group(1), 16))
+                funcs[func.name] = func
+                continue
+
+            m = INSN_RE.match(line)
+            if func is None or not m:
+                continue
+
+            op, args = m.group(2), m.group(3)
+
+            if op == '.word':
+                func.words.append(int(args.split()[0], 16))
+            elif op in ('push', 'push.w') or (op.startswith('stmdb') and
+                                                args.startswith('sp!')):
+                func.frame += 4 * reg_count(args[args.index('{'):])
+            elif op.startswith('vpush'):
+                size = 8 if 'd' in args else 4
+                func.frame += size * reg_count(args)
+            elif op.startswith('sub') and args.startswith('sp,'):
+                imm = re.search(r'#(\d+)', args)
+                if imm:
+                    func.frame += int(imm.group(1))
+            elif op in ('bl', 'blx', 'b', 'b.w', 'b.n'):
+                t = TARGET_RE.search(args)
+                if t and not t.group(2) and t.group(1) != func.name:
+                    func.calls.add(t.group(1))
+                elif op == 'blx' and args.startswith('r'):
+                    func.indirect = True
+            elif op == 'bx' and not args.startswith('lr'):
+                func.indirect = True
+
+    return funcs, data_words
+
+
+def read_su(su_dir):
+    frames = {}
+    for path in glob.glob(os.path.join(su_dir, '*.su')):
+        with open(path) as f:
+            for line in f:
+                fields = line.split('\t')
+                if len(fields) >= 2:
+                    frames[fields[0].split(':')[-1]] = int(fields[1])
+    return frames
+
+
+def main(dis_path, su_dir):
+    funcs, data_words = parse_disassembly(dis_path)
+
+    for name, frame in read_su(su_dir).items():
+        if name in funcs:
+            funcs[name].frame = frame
+
+    vectors = funcs.pop('g_pfnVectors', None)
+    if vectors is None:
+        sys.exit('no g_pfnVectors in {}'.format(dis_path))
+    by_addr = dict((f.addr, f.name) for f in funcs.values())
+    handlers = []
+    for word in vectors.words[1:]:
+        name = by_addr.get(word & ~1)
+        if name and name not in handlers:
+            handlers.append(name)
+
+    # Anything whose address is stored outside the vector table may be the
+    # target of an indirect call.
+    taken = set()
+    words = data_words + [w for f in funcs.values() for w in f.words]
+    for word in words:
+        name = by_addr.get(word & ~1)
+        if name:
+            taken.add(name)
+
+    recursive = set()
+    memo = {}
+
+    def depth(name, active):
+        if name in memo:
+            return memo[name]
+        func = funcs.get(name)
+        if func is None:
+            return 0
+        if name in active:
+            recursive.add(name)
+            return 0
+        active.add(name)
+        callees = set(func.calls)
+        if func.indirect:
+            callees |= taken
+        deepest = max([depth(c, active) for c in callees] or [0])
+        active.discard(name)
+        memo[name] = func.frame + deepest
+        return memo[name]
+
+    thread = handlers[0]
+    isrs = handlers[1:]
+
+    print('Worst-case stack depth in bytes')
+    print('  {:<32} {:>6}'.format(thread + ' (thread)', depth(thread, set())))
+    isr_depths = []
+    levels = {}
+    for name in isrs:
+        d = depth(name, set()) + EXCEPTION_FRAME
+        isr_depths.append(d)
+        level = PRIORITIES.get(name, name)
+        levels[level] = max(levels.get(level, 0), d)
+        print('  {:<32} {:>6}'.format(name, d))
+
+    base = depth(thread, set())
+    print('')
+    print('Thread + deepest handler (equal priorities): {}'.format(
+        base + max(isr_depths or [0])))
+    print('Thread + deepest handler per priority level: {}'.format(
+        base + sum(levels.values())))
+    print('Thread + every handler nested:               {}'.format(
+        base + sum(isr_depths)))
+    print('(handler figures include a {}-byte exception frame)'.format(
+        EXCEPTION_FRAME))
+
+    indirect = sorted(f.name for f in funcs.values() if f.indirect)
+    if indirect:
+        print('')
+        print('Indirect calls assumed to reach any of {} address-taken '
+              'functions from: {}'.format(len(taken), ', '.join(indirect)))
+    if recursive:
+        print('')
+        print('WARNING: recursion through {}, depth not bounded'.format(
+            ', '.join(sorted(recursive))))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    main(sys.argv[1], sys.argv[2])
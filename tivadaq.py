@@ -0,0 +1,618 @@
+"""Host-side interface to the tiva-daq USB bulk device."""
+
+import array
+import collections
+import functools
+import math
+import select
+import socket
+import struct
+import time
+import numpy as np
+
+try:
+    import usb.core
+    import usb.util
+except ImportError:
+    # Only the virtual device can be used without pyusb.
+    usb = None
+
+# What a read that runs out of time raises, on USB or the virtual link.
+TIMEOUT_ERRORS = (socket.timeout,)
+if usb is not None and hasattr(usb.core, 'USBTimeoutError'):
+    TIMEOUT_ERRORS += (usb.core.USBTimeoutError,)
+
+# Bulk endpoint packet size at full speed.
+PACKET_SIZE = 64
+
+# CPU clock, the unit of frame timestamps.
+CLOCK_HZ = 50000000
+
+# Frame types and header, mirrored from include/protocol.h.
+FRAME_SAMPLES = 0x00
+FRAME_REPLY = 0x01
+FRAME_TELEMETRY = 0x02
+FRAME_LOGIC = 0x03
+FRAME_SPI = 0x04
+FRAME_SPECTRUM = 0x05
+FRAME_FEATURES = 0x06
+FRAME_TYPE_COUNT = 7
+
+FRAME_HEADER = struct.Struct('<BBHI')
+
+Frame = collections.namedtuple('Frame', 'type seq timestamp payload')
+
+TELEMETRY = struct.Struct('<IIIIHHHHIIIIIII')
+
+Telemetry = collections.namedtuple(
+    'Telemetry', 'tx_bytes rx_bytes dropped_frames dropped_samples '
+                 'tx_fill_min tx_fill_max timer_overruns idle_permille '
+                 'stack_high_water latency_max fft_cycles boot_cycles '
+                 'credits degraded_frames throttled_frames')
+
+LOGIC_HEADER = struct.Struct('<BBHII')
+
+Logic = collections.namedtuple(
+    'Logic', 'block period timestamp mask samples')
+
+SPI_HEADER = struct.Struct('<BBHII')
+
+Spi = collections.namedtuple('Spi', 'block period timestamp data')
+
+SAMPLES_HEADER = struct.Struct('<BBHII')
+
+Samples = collections.namedtuple(
+    'Samples', 'channel ain block period timestamp data')
+
+SPECTRUM_HEADER = struct.Struct('<HHI')
+
+Spectrum = collections.namedtuple(
+    'Spectrum', 'averages period timestamp freqs bins')
+
+FEATURES = struct.Struct('<BBHHHIIIIff')
+
+Features = collections.namedtuple(
+    'Features', 'channel ain min max peak crossings window period index '
+                'mean rms timestamp')
+
+# Command opcodes, mirrored from include/protocol.h.
+CMD_GET_STACK = 0x01
+CMD_LOOP = 0x02
+CMD_SET_LOW_LATENCY = 0x03
+CMD_SET_COALESCE = 0x04
+CMD_SET_TELEMETRY = 0x05
+CMD_SET_LOGIC = 0x06
+CMD_SET_SPI = 0x07
+CMD_SET_SPECTRUM = 0x08
+CMD_SET_CHANNELS = 0x09
+CMD_CLEAR_CONFIG = 0x0A
+CMD_SET_FEATURES = 0x0B
+CMD_GRANT_CREDITS = 0x0C
+CMD_SET_STREAMING = 0x0D
+
+COALESCE_MAX_PACKETS = 8
+COALESCE_ZLP = 0x01
+
+LOOP_OUTPUT_MAX = 4095
+
+LOGIC_MAX_RATE = 1000000
+LOGIC_BLOCK = 256
+LOGIC_RAW = 0x00
+LOGIC_RLE = 0x01
+
+SPI_MAX_RATE = 20000
+SPI_MIN_BIT_RATE = 769
+SPI_MAX_BIT_RATE = 25000000
+SPI_MAX_XFER = 8
+SPI_BLOCK = 32
+
+SPECTRUM_N = 256
+SPECTRUM_BINS = SPECTRUM_N // 2 + 1
+SPECTRUM_RAW = 0x01
+
+CHANNELS_MAX = 8
+CHANNELS_MAX_AIN = 11
+CHANNELS_MAX_RATE = 100000
+CHANNELS_MAX_SLOTS = 64
+CHANNELS_BLOCK = 32
+
+FEATURES_MIN_WINDOW = CHANNELS_BLOCK
+FEATURES_MAX_LEVEL = 4095
+
+CREDITS_ON = 0x01
+
+
+class FrameParser(object):
+    """Split the raw device stream into frames.
+
+    Frames can be split across reads, so any incomplete frame at the end of
+    the data is kept until the next call. Sequence numbers are checked per
+    frame type and gaps are added up in `dropped`.
+    """
+
+    def __init__(self):
+        self.data = b''
+        self.next_seq = {}
+        self.dropped = collections.Counter()
+
+    def feed(self, data):
+        """Add raw stream bytes and return the list of complete frames."""
+        self.data += data
+        frames = []
+        pos = 0
+        while len(self.data) - pos >= FRAME_HEADER.size:
+            ftype, seq, length, timestamp = FRAME_HEADER.unpack_from(
+                self.data, pos)
+            end = pos + FRAME_HEADER.size + length
+            if end > len(self.data):
+                break
+            frames.append(Frame(ftype, seq, timestamp,
+                                self.data[pos + FRAME_HEADER.size:end]))
+            pos = end
+
+            expected = self.next_seq.get(ftype)
+            if expected is not None:
+                self.dropped[ftype] += (seq - expected) & 0xff
+            self.next_seq[ftype] = (seq + 1) & 0xff
+
+        self.data = self.data[pos:]
+        return frames
+
+
+def parse_telemetry(frame):
+    """Unpack the payload of a FRAME_TELEMETRY frame."""
+    return Telemetry(*TELEMETRY.unpack(frame.payload[:TELEMETRY.size]))
+
+
+def parse_logic(frame):
+    """Unpack the payload of a FRAME_LOGIC frame.
+
+    `samples` holds one byte of port B pins per sample. Sample i was taken
+    at `timestamp + i * period` cycles, on the same clock as the other
+    frames' timestamps, and consecutive blocks have consecutive `block`
+    numbers unless some were lost.
+    """
+    encoding, mask, nsamples, period, block = LOGIC_HEADER.unpack_from(
+        frame.payload)
+    data = np.frombuffer(frame.payload, dtype=np.uint8,
+                         offset=LOGIC_HEADER.size)
+    if encoding == LOGIC_RLE:
+        samples = np.repeat(data[0::2], data[1::2].astype(np.intp) + 1)
+    else:
+        samples = data.copy()
+    return Logic(block, period, frame.timestamp, mask, samples)
+
+
+def parse_spi(frame):
+    """Unpack the payload of a FRAME_SPI frame.
+
+    `data` has one row of received bytes per transaction. Transaction i
+    started at `timestamp + i * period` cycles, and consecutive frames have
+    consecutive `block` numbers unless some were lost.
+    """
+    nbytes, count, _, period, block = SPI_HEADER.unpack_from(frame.payload)
+    data = np.frombuffer(frame.payload, dtype=np.uint8,
+                         offset=SPI_HEADER.size, count=nbytes * count)
+    return Spi(block, period, frame.timestamp, data.reshape(count, nbytes))
+
+
+def parse_samples(frame):
+    """Unpack the payload of a FRAME_SAMPLES frame.
+
+    `data` holds the 12-bit conversions of analog input `ain`, which is entry
+    `channel` of the set_channels() list. Each channel has its own timeline:
+    sample i was taken at `timestamp + i * period` cycles, and consecutive
+    frames of a channel have consecutive `block` numbers unless some were
+    lost.
+    """
+    channel, ain, nsamples, period, block = SAMPLES_HEADER.unpack_from(
+        frame.payload)
+    data = np.frombuffer(frame.payload, dtype='<u2',
+                         offset=SAMPLES_HEADER.size, count=nsamples)
+    return Samples(channel, ain, block, period, frame.timestamp, data)
+
+
+def channel_slots(divisors):
+    """Base ticks in the hyperperiod of a set of channel divisors.
+
+    This is what the device checks against CHANNELS_MAX_SLOTS, after taking
+    out the divisors' common factor.
+    """
+    common = functools.reduce(math.gcd, divisors)
+    return functools.reduce(lambda a, b: a * b // math.gcd(a, b),
+                            [d // common for d in divisors], 1)
+
+
+def parse_spectrum(frame):
+    """Unpack the payload of a FRAME_SPECTRUM frame.
+
+    `bins` holds the RMS-averaged magnitude of each bin, scaled so a sine
+    centred on a bin reads its amplitude, and `freqs` the bin frequencies in
+    Hz, from the sample `period` in cycles.
+    """
+    nfft, averages, period = SPECTRUM_HEADER.unpack_from(frame.payload)
+    bins = np.frombuffer(frame.payload, dtype='<f4',
+                         offset=SPECTRUM_HEADER.size, count=nfft // 2 + 1)
+    freqs = np.fft.rfftfreq(nfft, float(period) / CLOCK_HZ)
+    return Spectrum(averages, period, frame.timestamp, freqs, bins)
+
+
+def parse_features(frame):
+    """Unpack the payload of a FRAME_FEATURES frame.
+
+    The statistics cover `window` samples of a channel, starting at
+    `timestamp`. `peak`, `rms` and `crossings` are taken about the level
+    given to set_features(); `min`, `max` and `mean` are in plain ADC counts.
+    """
+    return Features(*(FEATURES.unpack_from(frame.payload) +
+                      (frame.timestamp,)))
+
+
+class SocketEndpoint(object):
+    """Stand-in for a pyusb bulk endpoint, talking to virtual_device.py.
+
+    Each USB packet travels over the socket as a 16-bit little-endian length
+    followed by the packet bytes; a zero length is a zero-length packet. Reads
+    follow USB bulk semantics: they return once `size` bytes have arrived or
+    a short packet ends the transfer.
+
+    A read that times out raises socket.timeout, as a USB read would raise
+    its own timeout error, but keeps whatever it had received for the next
+    read, so the stream stays in step. The socket itself has no timeout, so
+    writes from another thread aren't cut short by one given to a read.
+    """
+
+    wMaxPacketSize = PACKET_SIZE
+
+    def __init__(self, sock):
+        self.sock = sock
+        # packet payloads received but not yet returned, and the start of a
+        # packet not yet complete
+        self.pending = b''
+        self.partial = b''
+
+    def write(self, data, timeout=None):
+        if isinstance(data, str):
+            data = data.encode()
+        data = bytes(data)
+        msg = b''
+        for i in range(0, max(len(data), 1), PACKET_SIZE):
+            packet = data[i:i + PACKET_SIZE]
+            msg += struct.pack('<H', len(packet)) + packet
+        self.sock.sendall(msg)
+        return len(data)
+
+    def read(self, size_or_buffer, timeout=None):
+        if isinstance(size_or_buffer, int):
+            size, buf = size_or_buffer, None
+        else:
+            buf = size_or_buffer
+            size = len(buf) * buf.itemsize
+
+        deadline = None if timeout is None else time.monotonic() + timeout / 1e3
+        data = self.pending
+        self.pending = b''
+        try:
+            while len(data) < size:
+                packet = self._recv_packet(deadline)
+                data += packet
+                if len(packet) < PACKET_SIZE:
+                    break
+        except socket.timeout:
+            self.pending = data
+            raise
+        data, self.pending = data[:size], data[size:]
+
+        if buf is None:
+            return array.array('B', data)
+        memoryview(buf).cast('B')[:len(data)] = data
+        return len(data)
+
+    def _recv_packet(self, deadline):
+        self._recv_until(2, deadline)
+        (length,) = struct.unpack_from('<H', self.partial)
+        self._recv_until(2 + length, deadline)
+        packet = self.partial[2:2 + length]
+        self.partial = self.partial[2 + length:]
+        return packet
+
+    def _recv_until(self, n, deadline):
+        """Receive until at least `n` bytes are in self.partial."""
+        while len(self.partial) < n:
+            wait = None if deadline is None else deadline - time.monotonic()
+            if wait is not None and (wait <= 0 or not select.select(
+                    [self.sock], [], [], wait)[0]):
+                raise socket.timeout('timed out')
+            chunk = self.sock.recv(max(n - len(self.partial), 4096))
+            if not chunk:
+                raise IOError('virtual device closed the connection')
+            self.partial += chunk
+
+
+class TivaDaq(object):
+
+    id_vendor = 0x1cbe
+    id_product = 0x0003
+    buf_size = 256
+
+    def __init__(self, virtual=None):
+        """Open the device.
+
+        By default this opens the first LaunchPad found on USB. Pass
+        `virtual` as 'host:port' to connect to virtual_device.py instead.
+        """
+        if virtual is None:
+            self._open_usb()
+        else:
+            host, port = virtual.rsplit(':', 1)
+            sock = socket.create_connection((host, int(port)))
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            self.ep_in = self.ep_out = SocketEndpoint(sock)
+
+        self.read_size = self.ep_in.wMaxPacketSize
+        self.parser = FrameParser()
+        self.backlog = collections.deque()
+
+    def read(self, msg):
+        """Send `msg` and return the samples from the next sample frame."""
+        self.ep_out.write(msg)
+        frame = self._next_frame(lambda f: f.type == FRAME_SAMPLES)
+        return parse_samples(frame).data
+
+    def read_frames(self, size=16 * PACKET_SIZE, timeout=1000):
+        """Read up to `size` bytes of stream and return the frames in it.
+
+        Frames set aside while waiting for a command reply come first.
+        """
+        frames = list(self.backlog)
+        self.backlog.clear()
+        return frames + self.parser.feed(self.read_stream(size, timeout))
+
+    def stack_usage(self):
+        """Return (stack size, high-water mark) in bytes."""
+        self.ep_out.write(bytes([CMD_GET_STACK]))
+        payload = self._reply(CMD_GET_STACK)
+        cmd, size, high_water = struct.unpack('<B3xII', payload[:12])
+        return size, high_water
+
+    def set_telemetry(self, interval_ms):
+        """Have the device send a telemetry frame every `interval_ms`.
+
+        0 turns telemetry off. Use parse_telemetry() on the frames.
+        """
+        self.ep_out.write(struct.pack('<BH', CMD_SET_TELEMETRY, interval_ms))
+
+    def set_logic(self, rate_hz, mask=0xff):
+        """Capture the port B pins in `mask` at `rate_hz`, or stop if 0.
+
+        Use parse_logic() on the FRAME_LOGIC frames.
+        """
+        if not 0 <= rate_hz <= LOGIC_MAX_RATE:
+            raise ValueError('rate_hz must be 0 to {}'.format(LOGIC_MAX_RATE))
+        self.ep_out.write(struct.pack('<BBI', CMD_SET_LOGIC, mask,
+                                      int(rate_hz)))
+
+    def set_spi(self, rate_hz, tx=b'', bit_rate=1000000, mode=3):
+        """Read an SPI sensor on SSI0 at `rate_hz`, or stop if 0.
+
+        Each transaction clocks out the bytes of `tx` and keeps the bytes
+        clocked back in; `tx` must be 1, 2, 4 or 8 bytes long, so pad it with
+        dummy bytes. `bit_rate` is the SPI clock, from SPI_MIN_BIT_RATE to
+        SPI_MAX_BIT_RATE. Use parse_spi() on the FRAME_SPI frames.
+        """
+        tx = bytes(tx)
+        if rate_hz and len(tx) not in (1, 2, 4, 8):
+            raise ValueError('tx must be 1, 2, 4 or 8 bytes')
+        if not 0 <= rate_hz <= SPI_MAX_RATE:
+            raise ValueError('rate_hz must be 0 to {}'.format(SPI_MAX_RATE))
+        if not SPI_MIN_BIT_RATE <= bit_rate <= SPI_MAX_BIT_RATE:
+            raise ValueError('bit_rate must be {} to {}'.format(
+                SPI_MIN_BIT_RATE, SPI_MAX_BIT_RATE))
+        self.ep_out.write(struct.pack('<BBBxII8s', CMD_SET_SPI, len(tx), mode,
+                                      int(bit_rate), int(rate_hz), tx))
+
+    def set_channels(self, base_hz, channels):
+        """Choose the analog inputs to sample and their rates.
+
+        `channels` is a list of up to CHANNELS_MAX `(ain, divisor)` pairs;
+        analog input `ain` is then sampled at `base_hz / divisor`. Use
+        parse_samples() on the FRAME_SAMPLES frames, whose `channel` is the
+        index into this list. Sampling starts and stops with start() and
+        stop().
+        """
+        channels = list(channels)
+        if not 1 <= len(channels) <= CHANNELS_MAX:
+            raise ValueError('need 1 to {} channels'.format(CHANNELS_MAX))
+        if not 0 < base_hz <= CHANNELS_MAX_RATE:
+            raise ValueError('base_hz must be 1 to {}'.format(
+                CHANNELS_MAX_RATE))
+        for ain, divisor in channels:
+            if not 0 <= ain <= CHANNELS_MAX_AIN:
+                raise ValueError('ain must be 0 to {}'.format(
+                    CHANNELS_MAX_AIN))
+            if not 0 < divisor <= 0xffff:
+                raise ValueError('divisor must be 1 to 65535')
+        if channel_slots([d for _, d in channels]) > CHANNELS_MAX_SLOTS:
+            raise ValueError('divisors repeat over more than {} base '
+                             'periods'.format(CHANNELS_MAX_SLOTS))
+
+        msg = struct.pack('<BBxxI', CMD_SET_CHANNELS, len(channels),
+                          int(base_hz))
+        for ain, divisor in channels:
+            msg += struct.pack('<BxH', ain, divisor)
+        self.ep_out.write(msg)
+
+    def clear_config(self):
+        """Forget the settings the device has stored.
+
+        The device keeps the settings made with the set_*() methods here,
+        other than set_low_latency(), and whether sampling is on, and puts
+        them back as soon as it is connected after a reset. This stops that
+        until new settings are made; the ones in effect are left alone.
+        """
+        self.ep_out.write(bytes([CMD_CLEAR_CONFIG]))
+
+    def set_spectrum(self, averages, raw=False):
+        """Send averaged spectra of channel 0 instead of its samples.
+
+        Each spectrum averages `averages` Hann windows of SPECTRUM_N samples
+        overlapping by half; 0 goes back to plain samples. With `raw=True`
+        the sample frames are sent as well. Use parse_spectrum() on the
+        FRAME_SPECTRUM frames.
+        """
+        if not 0 <= averages <= 0xffff:
+            raise ValueError('averages must be 0 to 65535')
+        self.ep_out.write(struct.pack('<BBH', CMD_SET_SPECTRUM,
+                                      SPECTRUM_RAW if raw else 0,
+                                      int(averages)))
+
+    def set_features(self, window, level=2048, decimation=0):
+        """Send statistics over windows of each channel's samples.
+
+        Every `window` samples of each channel are reduced to one
+        FRAME_FEATURES frame (see parse_features()), with peak, RMS and zero
+        crossings taken about `level` in ADC counts. Each channel's sample
+        frames are replaced by ones averaging `decimation` samples into each,
+        or dropped if it is 0; 1 keeps them as they are. A `window` of 0
+        turns this off.
+        """
+        if window and not FEATURES_MIN_WINDOW <= window <= 0xffffffff:
+            raise ValueError('window must be 0 or {} to {}'.format(
+                FEATURES_MIN_WINDOW, 0xffffffff))
+        if not 0 <= level <= FEATURES_MAX_LEVEL:
+            raise ValueError('level must be 0 to {}'.format(
+                FEATURES_MAX_LEVEL))
+        if not 0 <= decimation <= 0xffff:
+            raise ValueError('decimation must be 0 to 65535')
+        self.ep_out.write(struct.pack('<BxHIH', CMD_SET_FEATURES, int(level),
+                                      int(window), int(decimation)))
+
+    def grant_credits(self, nbytes, low_water=0, decimation=1):
+        """Let the device send `nbytes` more bytes of stream.
+
+        The first grant turns on credit-based flow control, which lasts until
+        stop_credits() or the device is next configured. Frames the device
+        has no credit for are not sent, so grant more as the stream is
+        consumed, e.g. as it is written to disk. While the credit left is
+        below `low_water`, sample frames are sent averaged down by
+        `decimation`, which must divide CHANNELS_BLOCK. Replies and telemetry
+        need no credit.
+        """
+        if not 0 <= nbytes <= 0xffffffff:
+            raise ValueError('nbytes must be 0 to {}'.format(0xffffffff))
+        if not 0 <= low_water <= 0xffffffff:
+            raise ValueError('low_water must be 0 to {}'.format(0xffffffff))
+        if decimation < 1 or CHANNELS_BLOCK % decimation:
+            raise ValueError('decimation must divide {}'.format(
+                CHANNELS_BLOCK))
+        self.ep_out.write(struct.pack('<BBHII', CMD_GRANT_CREDITS, CREDITS_ON,
+                                      int(decimation), int(low_water),
+                                      int(nbytes)))
+
+    def stop_credits(self):
+        """Turn credit-based flow control off."""
+        self.ep_out.write(struct.pack('<BBHII', CMD_GRANT_CREDITS, 0, 0, 0, 0))
+
+    def start(self):
+        """Start sampling, if it isn't on already.
+
+        The device may have resumed sampling by itself after a reset (see
+        clear_config()), so use this rather than the legacy toggle.
+        """
+        self.ep_out.write(bytes([CMD_SET_STREAMING, 1]))
+
+    def stop(self):
+        """Stop sampling, if it is on."""
+        self.ep_out.write(bytes([CMD_SET_STREAMING, 0]))
+
+    def set_low_latency(self, enable):
+        """Enable or disable low-latency (closed-loop) mode.
+
+        Streaming is stopped while low-latency mode is on.
+        """
+        self.ep_out.write(bytes([CMD_SET_LOW_LATENCY, int(bool(enable))]))
+
+    def set_coalesce(self, packets=0, hold_ms=0, zlp=False):
+        """Set the transmit coalescing policy for this run.
+
+        The device holds data back until `packets` full packets are waiting
+        or the oldest byte has waited `hold_ms` milliseconds. `packets=0`
+        sends everything right away and `hold_ms=0` means no time limit. Use
+        `zlp=True` when reading in blocks larger than one packet so every
+        transfer is terminated.
+        """
+        if not 0 <= packets <= COALESCE_MAX_PACKETS:
+            raise ValueError('packets must be 0 to {}'.format(
+                COALESCE_MAX_PACKETS))
+        flags = COALESCE_ZLP if zlp else 0
+        self.ep_out.write(struct.pack('<BBHB', CMD_SET_COALESCE, packets,
+                                      hold_ms, flags))
+
+    def loop(self, output, seq=0):
+        """Set the PWM output and return the next AIN0 sample.
+
+        Both values are on a 12-bit scale (0 to LOOP_OUTPUT_MAX).
+        """
+        seq &= 0xff
+        self.ep_out.write(struct.pack('<BBH', CMD_LOOP, seq, output))
+        while True:
+            payload = self._reply(CMD_LOOP)
+            cmd, rseq, sample = struct.unpack('<BBH', payload[:4])
+            # A reply from an earlier request that timed out on our side
+            # can still be in the pipe; skip it.
+            if rseq == seq:
+                return sample
+
+    def read_stream(self, size, timeout=1000):
+        """Read up to `size` bytes of the raw stream as a bytes object.
+
+        Raises one of TIMEOUT_ERRORS if nothing arrives within `timeout` ms.
+        """
+        return bytes(self.ep_in.read(size, timeout))
+
+    def _next_frame(self, match):
+        """Return the next frame for which `match` is true.
+
+        Other frames that arrive in the meantime are kept for read_frames().
+        """
+        skipped = []
+        try:
+            while True:
+                while self.backlog:
+                    frame = self.backlog.popleft()
+                    if match(frame):
+                        return frame
+                    skipped.append(frame)
+                self.backlog.extend(
+                    self.parser.feed(self.read_stream(self.read_size)))
+        finally:
+            self.backlog.extendleft(reversed(skipped))
+
+    def _reply(self, cmd):
+        """Return the payload of the next reply to command `cmd`."""
+        frame = self._next_frame(
+            lambda f: f.type == FRAME_REPLY and f.payload[:1] == bytes([cmd]))
+        return frame.payload
+
+    def _open_usb(self):
+        if usb is None:
+            raise ValueError('pyusb is needed to open a real device')
+
+        self.dev = usb.core.find(idVendor=self.id_vendor,
+                                 idProduct=self.id_product)
+
+        if self.dev is None:
+            raise ValueError('Device not found')
+
+        self.dev.set_configuration()
+
+        self.cfg = self.dev.get_active_configuration()
+        self.intf = self.cfg[(0, 0)]
+
+        self.ep_in = self._find_ep(usb.util.ENDPOINT_IN)
+        self.ep_out = self._find_ep(usb.util.ENDPOINT_OUT)
+
+    def _find_ep(self, io):
+        def match(ep):
+            return usb.util.endpoint_direction(ep.bEndpointAddress) == io
+        return usb.util.find_descriptor(self.intf, custom_match=match)
@@ -0,0 +1,720 @@
+"""Virtual tiva-daq device for testing the host side without hardware.
+
+Listens on a local TCP port and speaks the same command and stream protocol as
+the firmware, with USB packets carried as described in tivadaq.SocketEndpoint.
+Connect to it with ``TivaDaq(virtual='localhost:5555')``.
+
+Analog input AIN k carries a synthetic sine wave at k + 1 times the --freq
+frequency plus noise, at any rate you like, including rates far above what
+the real hardware can do. In logic-analyzer mode, pin 0 follows the sign of
+the AIN0 sine and the other pins count up, so the alignment of the two
+streams can be checked. SPI acquisition returns a 16-bit big-endian version of the
+sine after the first byte of each transaction, as a typical sensor register
+read would. Drops (whole sample frames lost, as when the
+device's transmit buffer is full) and delivery jitter can be injected to
+exercise the host's handling of both.
+
+Each connection stands for a reset of the device followed by the host
+configuring it. Settings are kept from one connection to the next, as the
+device keeps them in EEPROM, until the virtual device is restarted.
+"""
+
+import argparse
+import socket
+import struct
+import threading
+import time
+import numpy as np
+
+from tivadaq import (PACKET_SIZE, CLOCK_HZ, FRAME_HEADER, FRAME_SAMPLES,
+                     FRAME_REPLY, FRAME_TELEMETRY, FRAME_LOGIC,
+                     FRAME_SPI, FRAME_SPECTRUM, FRAME_FEATURES,
+                     FRAME_TYPE_COUNT, TELEMETRY,
+                     LOGIC_HEADER, SPI_HEADER, SPECTRUM_HEADER, CMD_GET_STACK, CMD_LOOP, CMD_SET_LOW_LATENCY,
+                     CMD_SET_COALESCE, CMD_SET_TELEMETRY, CMD_SET_LOGIC,
+                     CMD_SET_SPI, CMD_SET_SPECTRUM, CMD_SET_CHANNELS,
+                     CMD_CLEAR_CONFIG, CMD_SET_FEATURES, CMD_GRANT_CREDITS,
+                     CMD_SET_STREAMING,
+                     COALESCE_MAX_PACKETS, COALESCE_ZLP,
+                     LOOP_OUTPUT_MAX, LOGIC_MAX_RATE, LOGIC_BLOCK, LOGIC_RAW,
+                     LOGIC_RLE, SPI_MAX_RATE, SPI_MIN_BIT_RATE,
+                     SPI_MAX_BIT_RATE, SPI_BLOCK, SPECTRUM_N,
+                     SPECTRUM_RAW, CHANNELS_MAX, CHANNELS_MAX_AIN,
+                     CHANNELS_MAX_RATE, CHANNELS_MAX_SLOTS, CHANNELS_BLOCK,
+                     FEATURES_MIN_WINDOW, FEATURES_MAX_LEVEL, CREDITS_ON,
+                     channel_slots)
+
+# Most blocks of a channel generated in one go, which bounds the size of
+# each burst.
+MAX_BLOCKS_PER_BATCH = 256
+
+# Settings commands the device keeps across resets, in the order it replays
+# them.
+PERSISTED_COMMANDS = (CMD_SET_COALESCE, CMD_SET_TELEMETRY, CMD_SET_CHANNELS,
+                      CMD_SET_SPECTRUM, CMD_SET_FEATURES, CMD_SET_LOGIC,
+                      CMD_SET_SPI)
+
+# Frame header and statistics of a FRAME_FEATURES frame.
+FEATURES_FRAME = np.dtype([('type', 'u1'), ('seq', 'u1'), ('length', '<u2'),
+                           ('timestamp', '<u4'), ('channel', 'u1'),
+                           ('ain', 'u1'), ('min', '<u2'), ('max', '<u2'),
+                           ('peak', '<u2'), ('crossings', '<u4'),
+                           ('window', '<u4'), ('period', '<u4'),
+                           ('index', '<u4'), ('mean', '<f4'), ('rms', '<f4')])
+
+# Stack figures reported for CMD_GET_STACK and in telemetry.
+STACK_SIZE = 1024
+STACK_HIGH_WATER = 0
+
+# CPU idle time reported in telemetry, in tenths of a percent, and the
+# worst-case scheduling latency in cycles.
+IDLE_PERMILLE = 900
+LATENCY_MAX = 200
+
+# Cycles the firmware takes per spectrum window, reported in telemetry.
+FFT_CYCLES = 30000
+
+
+def samples_frame(nsamples):
+    """Frame header, sample header and samples of a FRAME_SAMPLES frame."""
+    return np.dtype([('type', 'u1'), ('seq', 'u1'), ('length', '<u2'),
+                     ('timestamp', '<u4'), ('channel', 'u1'), ('ain', 'u1'),
+                     ('nsamples', '<u2'), ('period', '<u4'),
+                     ('block', '<u4'), ('data', '<u2', (nsamples,))])
+
+
+def rle_encode(samples):
+    """Run-length encode logic samples as the firmware does."""
+    starts = np.concatenate(([0], np.flatnonzero(np.diff(samples)) + 1))
+    lengths = np.diff(np.append(starts, len(samples)))
+
+    # Runs longer than 256 samples are split.
+    pieces = (lengths + 255) // 256
+    values = np.repeat(samples[starts], pieces)
+    counts = np.full(len(values), 256)
+    counts[np.cumsum(pieces) - 1] = lengths - 256 * (pieces - 1)
+
+    return np.column_stack([values, counts - 1]).astype(np.uint8).tobytes()
+
+
+class VirtualDevice(object):
+
+    def __init__(self, conn, args, store):
+        self.conn = conn
+        self.args = args
+        self.store = store
+        self.rng = np.random.default_rng(args.seed)
+        self.lock = threading.Lock()
+        self.closed = False
+
+        self.streaming = False
+        self.low_latency = False
+        self.coalesce_packets = 0
+        self.coalesce_hold = 0.0
+        self.coalesce_zlp = False
+        self.pending = bytearray()
+        self.pending_since = 0.0
+        self.start = time.perf_counter()
+        self.base_period = int(CLOCK_HZ / args.rate)
+        self.channels = [(0, 1)]
+        self.channels_origin = 0.0
+        self.channels_block = [0] * CHANNELS_MAX
+        self.seq = [0] * FRAME_TYPE_COUNT
+        self.logic_period = 0
+        self.logic_mask = 0
+        self.logic_origin = 0.0
+        self.logic_block = 0
+        self.spi_period = 0
+        self.spi_nbytes = 0
+        self.spi_origin = 0.0
+        self.spi_block = 0
+        self.spectrum_averages = 0
+        self.spectrum_raw = False
+        self.spectrum_input = np.zeros(0, dtype=np.float32)
+        self.spectrum_power = 0.0
+        self.spectrum_count = 0
+        self.features_window = 0
+        self.features_level = 0
+        self.features_decimation = 0
+        self.features = [None] * CHANNELS_MAX
+        self.telemetry_interval = 0.0
+        self.last_telemetry = 0.0
+        self.tx_bytes = 0
+        self.rx_bytes = 0
+        self.dropped_frames = 0
+        self.dropped_samples = 0
+        self.fill_max = 0
+        self.boot_cycles = 0
+        self.credits_on = False
+        self.credits = 0
+        self.credit_low_water = 0
+        self.credit_decimation = 1
+        self.degraded_frames = 0
+        self.throttled_frames = 0
+
+    def run(self):
+        streamer = threading.Thread(target=self._stream)
+        streamer.daemon = True
+        streamer.start()
+        self._resume()
+        try:
+            while True:
+                self.handle(self._recv_packet())
+        except (IOError, OSError):
+            pass
+        finally:
+            self.closed = True
+            streamer.join()
+
+    def handle(self, cmd):
+        self.rx_bytes += len(cmd)
+        self._command(cmd)
+
+    def _resume(self):
+        """Replay the kept settings, as the device does once USB is first
+        configured after a reset."""
+        for op in PERSISTED_COMMANDS:
+            if op in self.store:
+                self._command(self.store[op])
+        if self.store.get('streaming'):
+            self._set_streaming(True)
+
+    def _command(self, cmd):
+        op = cmd[0] if cmd else 0
+
+        if op == CMD_LOOP:
+            _, seq, output = struct.unpack('<BBH', cmd[:4])
+            noise = self.rng.normal(0, self.args.noise * LOOP_OUTPUT_MAX)
+            sample = int(np.clip(output + noise, 0, LOOP_OUTPUT_MAX))
+            self.send_frame(FRAME_REPLY,
+                            struct.pack('<BBH', CMD_LOOP, seq, sample))
+        elif op == CMD_SET_LOW_LATENCY:
+            self.low_latency = cmd[1] != 0
+            if self.low_latency:
+                self._set_streaming(False)
+        elif op == CMD_SET_COALESCE:
+            _, packets, hold_ms, flags = struct.unpack('<BBHB', cmd[:5])
+            with self.lock:
+                self.coalesce_packets = min(packets, COALESCE_MAX_PACKETS)
+                self.coalesce_hold = hold_ms / 1000.0
+                self.coalesce_zlp = (flags & COALESCE_ZLP) != 0
+                self._flush()
+            self.store[op] = bytes(cmd)
+        elif op == CMD_GET_STACK:
+            self.send_frame(FRAME_REPLY,
+                            struct.pack('<B3xII', CMD_GET_STACK, STACK_SIZE,
+                                        STACK_HIGH_WATER))
+        elif op == CMD_SET_TELEMETRY:
+            (interval_ms,) = struct.unpack('<H', cmd[1:3])
+            self.telemetry_interval = interval_ms / 1000.0
+            self.last_telemetry = time.perf_counter()
+            self.store[op] = bytes(cmd)
+        elif op == CMD_SET_LOGIC:
+            _, mask, rate = struct.unpack('<BBI', cmd[:6])
+            self.logic_mask = mask
+            self.logic_block = 0
+            self.logic_origin = time.perf_counter() - self.start
+            self.logic_period = (CLOCK_HZ // min(rate, LOGIC_MAX_RATE)
+                                 if rate else 0)
+            self.store[op] = bytes(cmd)
+        elif op == CMD_SET_SPI:
+            _, nbytes, mode, bit_rate, rate = struct.unpack('<BBBxII',
+                                                            cmd[:12])
+            # like the device, a bad command leaves acquisition alone
+            if (not rate or (nbytes in (1, 2, 4, 8) and mode <= 3 and
+                    SPI_MIN_BIT_RATE <= bit_rate <= SPI_MAX_BIT_RATE)):
+                self.spi_nbytes = nbytes
+                self.spi_block = 0
+                self.spi_origin = time.perf_counter() - self.start
+                self.spi_period = (CLOCK_HZ // min(rate, SPI_MAX_RATE)
+                                   if rate else 0)
+                self.store[op] = bytes(cmd)
+        elif op == CMD_SET_SPECTRUM:
+            _, flags, averages = struct.unpack('<BBH', cmd[:4])
+            self.spectrum_averages = averages
+            self.spectrum_raw = (flags & SPECTRUM_RAW) != 0
+            self.spectrum_input = np.zeros(0, dtype=np.float32)
+            self.spectrum_power = 0.0
+            self.spectrum_count = 0
+            self.store[op] = bytes(cmd)
+        elif op == CMD_SET_FEATURES:
+            _, level, window, decimation = struct.unpack('<BxHIH', cmd[:10])
+            if ((not window or window >= FEATURES_MIN_WINDOW) and
+                    level <= FEATURES_MAX_LEVEL):
+                self.features_window = window
+                self.features_level = level
+                self.features_decimation = decimation
+                self.features = [None] * CHANNELS_MAX
+                self.store[op] = bytes(cmd)
+        elif op == CMD_SET_CHANNELS:
+            _, count, base_hz = struct.unpack('<BBxxI', cmd[:8])
+            channels = [struct.unpack_from('<BxH', cmd, 8 + 4 * i)
+                        for i in range(min(count, CHANNELS_MAX))]
+            divisors = [d for _, d in channels]
+            if (1 <= count <= CHANNELS_MAX and
+                    0 < base_hz <= CHANNELS_MAX_RATE and
+                    all(ain <= CHANNELS_MAX_AIN for ain, _ in channels) and
+                    all(divisors) and
+                    channel_slots(divisors) <= CHANNELS_MAX_SLOTS):
+                self.base_period = CLOCK_HZ // base_hz
+                self.channels = channels
+                self._restart_channels()
+                self.store[op] = bytes(cmd)
+        elif op == CMD_GRANT_CREDITS:
+            _, flags, decimation, low_water, credits = struct.unpack(
+                '<BBHII', cmd[:12])
+            with self.lock:
+                if not flags & CREDITS_ON:
+                    self.credits_on = False
+                elif decimation and CHANNELS_BLOCK % decimation == 0:
+                    self.credits = min((self.credits if self.credits_on
+                                        else 0) + credits, 0xffffffff)
+                    self.credit_low_water = low_water
+                    self.credit_decimation = decimation
+                    self.credits_on = True
+        elif op == CMD_CLEAR_CONFIG:
+            self.store.clear()
+        elif op == CMD_SET_STREAMING:
+            self._set_streaming(len(cmd) > 1 and cmd[1] != 0)
+        else:
+            self._set_streaming(not self.streaming)
+
+    def _set_streaming(self, enable):
+        if enable and not self.streaming:
+            self._restart_channels()
+        self.streaming = enable
+        self.store['streaming'] = enable
+
+    def _restart_channels(self):
+        # As on the device, every channel starts over from block 0.
+        self.channels_origin = time.perf_counter() - self.start
+        self.channels_block = [0] * CHANNELS_MAX
+        self.features = [None] * CHANNELS_MAX
+
+    def timestamp(self, t=None):
+        """Device cycle counter for `t` seconds since the start, or now."""
+        if t is None:
+            t = time.perf_counter() - self.start
+        return int(t * CLOCK_HZ) & 0xffffffff
+
+    def send_frame(self, ftype, payload):
+        self._send_frame_at(ftype, self.timestamp(), payload)
+
+    def _send_frame_at(self, ftype, timestamp, payload):
+        header = FRAME_HEADER.pack(ftype, self.seq[ftype], len(payload),
+                                   timestamp)
+        self.seq[ftype] = (self.seq[ftype] + 1) & 0xff
+        if (ftype in (FRAME_REPLY, FRAME_TELEMETRY) or
+                self._meter(1, len(header + payload))):
+            self.write(header + payload)
+
+    def _meter(self, count, size):
+        """Use up the credit for `count` frames of `size` bytes each, as far
+        as it goes, and return how many of them can be sent."""
+        with self.lock:
+            if not self.credits_on:
+                return count
+            allowed = min(count, self.credits // size)
+            self.credits -= allowed * size
+            self.throttled_frames += count - allowed
+            return allowed
+
+    def send_telemetry(self):
+        with self.lock:
+            fill = len(self.pending)
+            fill_max = max(self.fill_max, fill)
+            self.fill_max = 0
+        self.send_frame(FRAME_TELEMETRY, TELEMETRY.pack(
+            self.tx_bytes & 0xffffffff, self.rx_bytes & 0xffffffff,
+            self.dropped_frames, self.dropped_samples, 0, fill_max, 0,
+            IDLE_PERMILLE, STACK_HIGH_WATER, LATENCY_MAX,
+            FFT_CYCLES if self.spectrum_averages else 0, self.boot_cycles,
+            self.credits if self.credits_on else 0, self.degraded_frames,
+            self.throttled_frames))
+
+    def write(self, data):
+        """Queue data for the host, following the coalescing policy."""
+        with self.lock:
+            if not self.pending:
+                self.pending_since = time.perf_counter()
+            self.pending += data
+            self.fill_max = max(self.fill_max, len(self.pending))
+            threshold = self.coalesce_packets * PACKET_SIZE
+            if self.low_latency or len(self.pending) >= threshold:
+                self._flush()
+
+    def _flush(self):
+        data = bytes(self.pending)
+        self.pending = bytearray()
+        if not data:
+            return
+
+        # Build all the full packets in one go so high rates stay cheap.
+        nfull = len(data) // PACKET_SIZE
+        full = np.frombuffer(data[:nfull * PACKET_SIZE], dtype=np.uint8)
+        header = np.frombuffer(struct.pack('<H', PACKET_SIZE), dtype=np.uint8)
+        msg = np.hstack([np.tile(header, (nfull, 1)),
+                         full.reshape(nfull, PACKET_SIZE)]).tobytes()
+
+        tail = data[nfull * PACKET_SIZE:]
+        if tail or self.coalesce_zlp:
+            msg += struct.pack('<H', len(tail)) + tail
+
+        self.conn.sendall(msg)
+        self.tx_bytes += len(data)
+
+    def _stream(self):
+        while not self.closed:
+            now = time.perf_counter()
+
+            if (self.telemetry_interval and
+                    now - self.last_telemetry >= self.telemetry_interval):
+                self.last_telemetry = now
+                self.send_telemetry()
+
+            if not (self.streaming or self.logic_period or self.spi_period):
+                time.sleep(0.01)
+                continue
+
+            wake = now + 0.01
+            if self.streaming:
+                wake = min(wake, self._channels(now))
+            if self.logic_period:
+                wake = min(wake, self._logic(now))
+            if self.spi_period:
+                wake = min(wake, self._spi(now))
+
+            with self.lock:
+                if (self.pending and self.coalesce_hold and
+                        now - self.pending_since >= self.coalesce_hold):
+                    self._flush()
+
+            delay = wake - time.perf_counter()
+            if self.args.jitter_ms:
+                delay += self.rng.uniform(0, self.args.jitter_ms / 1000.0)
+            if delay > 0:
+                time.sleep(delay)
+
+    def _channels(self, now):
+        """Send the sample blocks due by `now` and return when the next is."""
+        elapsed = now - self.start - self.channels_origin
+        wake = now + 0.01
+        for c, (ain, divisor) in enumerate(self.channels):
+            block_time = (CHANNELS_BLOCK * self.base_period * divisor /
+                          float(CLOCK_HZ))
+            due = min(int(elapsed / block_time) - self.channels_block[c],
+                      MAX_BLOCKS_PER_BATCH)
+            if due > 0:
+                self._generate(c, due)
+            wake = min(wake, self.start + self.channels_origin +
+                       (self.channels_block[c] + 1) * block_time)
+        return wake
+
+    def _generate(self, channel, blocks):
+        ain, divisor = self.channels[channel]
+        period = self.base_period * divisor
+        first = self.channels_block[channel]
+        self.channels_block[channel] += blocks
+
+        n = (first * CHANNELS_BLOCK +
+             np.arange(blocks * CHANNELS_BLOCK, dtype=np.int64))
+        t = self.channels_origin + n * period / float(CLOCK_HZ)
+        value = (np.sin(2 * np.pi * self.args.freq * (ain + 1) * t) +
+                 self.rng.normal(0, self.args.noise, len(n)))
+        samples = np.clip(np.round(2048 + 2000 * value), 0, 4095)
+
+        if not self.boot_cycles:
+            self.boot_cycles = (int(self.channels_origin * CLOCK_HZ) +
+                                int(n[0]) * period) & 0xffffffff
+
+        send = True
+        if channel == 0 and self.spectrum_averages:
+            self._spectrum(samples.astype(np.float32), period)
+            send = self.spectrum_raw
+
+        if self.features_window:
+            self._features(channel, samples, int(n[0]), send)
+            send = send and self.features_decimation == 1
+
+        if send:
+            self._send_samples(channel, period, first, int(n[0]) * period,
+                               samples)
+
+    def _send_samples(self, channel, period, block, offset, samples):
+        """Send samples as consecutive blocks of a channel.
+
+        `block` is the number of the first block and `offset` the time of its
+        first sample, in cycles from the channels' origin.
+        """
+        blocks = len(samples) // CHANNELS_BLOCK
+        samples = samples.reshape(blocks, CHANNELS_BLOCK)
+        block_period = CHANNELS_BLOCK * period
+
+        # Short of credit, every block is averaged down. Unlike the device,
+        # this is decided once for the whole batch.
+        factor = self.credit_decimation
+        if (self.credits_on and self.credits < self.credit_low_water and
+                factor > 1):
+            samples = samples.reshape(blocks, -1, factor).sum(axis=2)
+            samples = (samples + factor // 2) // factor
+            period *= factor
+            self.degraded_frames += blocks
+        dtype = samples_frame(samples.shape[1])
+
+        # One sample frame per block, built for all blocks at once and
+        # stamped with the time of its first sample.
+        frames = np.zeros(blocks, dtype=dtype)
+        frames['type'] = FRAME_SAMPLES
+        frames['seq'] = (self.seq[FRAME_SAMPLES] + np.arange(blocks)) & 0xff
+        frames['length'] = dtype.itemsize - FRAME_HEADER.size
+        frames['timestamp'] = (
+            int(self.channels_origin * CLOCK_HZ) + offset +
+            np.arange(blocks, dtype=np.int64) * block_period) & 0xffffffff
+        frames['channel'] = channel
+        frames['ain'] = self.channels[channel][0]
+        frames['nsamples'] = samples.shape[1]
+        frames['period'] = period
+        frames['block'] = block + np.arange(blocks)
+        frames['data'] = samples
+        self.seq[FRAME_SAMPLES] = (self.seq[FRAME_SAMPLES] + blocks) & 0xff
+
+        # Dropped frames still use up their sequence numbers, as on the
+        # device.
+        if self.args.drop:
+            keep = self.rng.random(blocks) >= self.args.drop
+            self.dropped_frames += blocks - keep.sum()
+            self.dropped_samples += (blocks - keep.sum()) * CHANNELS_BLOCK
+            frames = frames[keep]
+
+        # Frames the credit doesn't cover are lost the same way.
+        allowed = self._meter(len(frames), dtype.itemsize)
+        self.dropped_samples += (len(frames) - allowed) * CHANNELS_BLOCK
+        self.write(frames[:allowed].tobytes())
+
+    def _spectrum(self, samples, period):
+        """Feed samples to the spectrum and send each one finished."""
+        half = SPECTRUM_N // 2
+        window = 0.5 - 0.5 * np.cos(2 * np.pi * np.arange(SPECTRUM_N) /
+                                    SPECTRUM_N)
+        scale = np.full(half + 1, 2.0 / half)
+        scale[[0, -1]] = 1.0 / half
+
+        data = np.concatenate((self.spectrum_input, samples))
+        pos = 0
+        while len(data) - pos >= SPECTRUM_N:
+            x = np.fft.rfft(data[pos:pos + SPECTRUM_N] * window)
+            self.spectrum_power = self.spectrum_power + np.abs(x) ** 2
+            self.spectrum_count += 1
+            pos += half
+
+            if self.spectrum_count == self.spectrum_averages:
+                bins = (np.sqrt(self.spectrum_power / self.spectrum_count) *
+                        scale).astype('<f4')
+                self.spectrum_power = 0.0
+                self.spectrum_count = 0
+                self.send_frame(FRAME_SPECTRUM, SPECTRUM_HEADER.pack(
+                    SPECTRUM_N, self.spectrum_averages, period) +
+                    bins.tobytes())
+        self.spectrum_input = data[pos:]
+
+    def _features(self, channel, samples, start, send):
+        """Feed a channel's samples to its feature windows and decimation,
+        sending each window finished and, if `send`, each decimated block.
+
+        `start` is the index of the first sample on the channel's timeline.
+        """
+        ain, divisor = self.channels[channel]
+        period = self.base_period * divisor
+        window = self.features_window
+        level = self.features_level
+        decimation = self.features_decimation
+
+        # Samples not yet in a finished window or decimated block and the
+        # index of the first of each, which side of the level the signal was
+        # on at the end of the last window, and the window and block counts.
+        state = self.features[channel]
+        if state is None:
+            empty = np.zeros(0, dtype=samples.dtype)
+            state = self.features[channel] = {
+                'input': empty, 'start': start, 'side': 0, 'index': 0,
+                'dec_input': empty, 'dec_start': start, 'block': 0}
+
+        data = np.concatenate((state['input'], samples))
+        count = len(data) // window
+        if count:
+            x = data[:count * window].reshape(count, window)
+            d = x - float(level)
+
+            # A sample on the level counts as on the side of the one before.
+            side = np.concatenate(([state['side']], np.sign(d).ravel()))
+            last = np.where(side != 0, np.arange(len(side)), 0)
+            side = side[np.maximum.accumulate(last)]
+            crossed = (side[1:] == -side[:-1]) & (side[:-1] != 0)
+            state['side'] = side[-1]
+
+            frames = np.zeros(count, dtype=FEATURES_FRAME)
+            frames['type'] = FRAME_FEATURES
+            frames['seq'] = (self.seq[FRAME_FEATURES] +
+                             np.arange(count)) & 0xff
+            frames['length'] = FEATURES_FRAME.itemsize - FRAME_HEADER.size
+            frames['timestamp'] = (
+                int(self.channels_origin * CLOCK_HZ) +
+                (state['start'] + np.arange(count, dtype=np.int64) * window) *
+                period) & 0xffffffff
+            frames['channel'] = channel
+            frames['ain'] = ain
+            frames['min'] = x.min(axis=1)
+            frames['max'] = x.max(axis=1)
+            frames['peak'] = np.abs(d).max(axis=1)
+            frames['crossings'] = crossed.reshape(count, window).sum(axis=1)
+            frames['window'] = window
+            frames['period'] = period
+            frames['index'] = state['index'] + np.arange(count)
+            frames['mean'] = x.mean(axis=1)
+            frames['rms'] = np.sqrt((d ** 2).mean(axis=1))
+            self.seq[FRAME_FEATURES] = (self.seq[FRAME_FEATURES] +
+                                        count) & 0xff
+            allowed = self._meter(count, FEATURES_FRAME.itemsize)
+            self.write(frames[:allowed].tobytes())
+
+            state['index'] += count
+            state['start'] += count * window
+        state['input'] = data[count * window:]
+
+        if decimation > 1:
+            span = decimation * CHANNELS_BLOCK
+            data = np.concatenate((state['dec_input'], samples))
+            count = len(data) // span
+            if count:
+                sums = data[:count * span].reshape(-1, decimation).sum(axis=1)
+                if send:
+                    self._send_samples(channel, period * decimation,
+                                       state['block'],
+                                       state['dec_start'] * period,
+                                       (sums + decimation // 2) // decimation)
+                state['block'] += count
+                state['dec_start'] += count * span
+            state['dec_input'] = data[count * span:]
+
+    def _logic(self, now):
+        """Send the logic blocks due by `now` and return when the next is."""
+        rate = CLOCK_HZ / float(self.logic_period)
+        block_time = LOGIC_BLOCK / rate
+        elapsed = now - self.start - self.logic_origin
+        due = min(int(elapsed / block_time) - self.logic_block,
+                  MAX_BLOCKS_PER_BATCH)
+
+        for _ in range(max(due, 0)):
+            block = self.logic_block
+            self.logic_block += 1
+
+            n = block * LOGIC_BLOCK + np.arange(1, LOGIC_BLOCK + 1)
+            t = self.logic_origin + n / rate
+            samples = ((n >> 4) << 1) & 0xfe
+            samples |= np.sin(2 * np.pi * self.args.freq * t) > 0
+            samples = samples.astype(np.uint8) & self.logic_mask
+
+            if self.args.drop and self.rng.random() < self.args.drop:
+                self.dropped_samples += LOGIC_BLOCK
+                continue
+
+            encoding, data = LOGIC_RLE, rle_encode(samples)
+            if len(data) >= LOGIC_BLOCK:
+                encoding, data = LOGIC_RAW, samples.tobytes()
+            header = LOGIC_HEADER.pack(encoding, self.logic_mask, LOGIC_BLOCK,
+                                       self.logic_period, block)
+            timestamp = self.timestamp(self.logic_origin + n[0] / rate)
+            self._send_frame_at(FRAME_LOGIC, timestamp, header + data)
+
+        return (self.start + self.logic_origin +
+                (self.logic_block + 1) * block_time)
+
+    def _spi(self, now):
+        """Send the SPI blocks due by `now` and return when the next is."""
+        rate = CLOCK_HZ / float(self.spi_period)
+        block_time = SPI_BLOCK / rate
+        elapsed = now - self.start - self.spi_origin
+        due = min(int(elapsed / block_time) - self.spi_block,
+                  MAX_BLOCKS_PER_BATCH)
+
+        for _ in range(max(due, 0)):
+            block = self.spi_block
+            self.spi_block += 1
+
+            n = block * SPI_BLOCK + np.arange(1, SPI_BLOCK + 1)
+            t = self.spi_origin + n / rate
+            value = (32767 * np.sin(2 * np.pi * self.args.freq * t) +
+                     self.rng.normal(0, self.args.noise * 32767, SPI_BLOCK))
+            value = np.clip(value, -32768, 32767).astype('>i2')
+            data = np.zeros((SPI_BLOCK, self.spi_nbytes + 2), dtype=np.uint8)
+            data[:, 1:3] = value.view(np.uint8).reshape(SPI_BLOCK, 2)
+            data = data[:, :self.spi_nbytes]
+
+            if self.args.drop and self.rng.random() < self.args.drop:
+                self.dropped_samples += SPI_BLOCK
+                continue
+
+            header = SPI_HEADER.pack(self.spi_nbytes, SPI_BLOCK, 0,
+                                     self.spi_period, block)
+            timestamp = self.timestamp(self.spi_origin + n[0] / rate)
+            self._send_frame_at(FRAME_SPI, timestamp,
+                                header + data.tobytes())
+
+        return (self.start + self.spi_origin +
+                (self.spi_block + 1) * block_time)
+
+    def _recv_packet(self):
+        (length,) = struct.unpack('<H', self._recv_exact(2))
+        return self._recv_exact(length)
+
+    def _recv_exact(self, n):
+        data = b''
+        while len(data) < n:
+            chunk = self.conn.recv(n - len(data))
+            if not chunk:
+                raise IOError('host closed the connection')
+            data += chunk
+        return data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--host', default='localhost',
+                        help='address to listen on')
+    parser.add_argument('-p', '--port', type=int, default=5555,
+                        help='port to listen on')
+    parser.add_argument('-r', '--rate', type=float, default=32.0,
+                        help='AIN0 sample rate at reset, in samples per '
+                             'second')
+    parser.add_argument('-f', '--freq', type=float, default=1.0,
+                        help='frequency of the synthetic sine in Hz')
+    parser.add_argument('--noise', type=float, default=0.01,
+                        help='standard deviation of added noise, relative '
+                             'to full scale')
+    parser.add_argument('--drop', type=float, default=0.0,
+                        help='probability of dropping each sample frame')
+    parser.add_argument('--jitter-ms', type=float, default=0.0,
+                        help='maximum random delay added before each burst')
+    parser.add_argument('--seed', type=int, default=None,
+                        help='random seed for repeatable runs')
+    args = parser.parse_args()
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind((args.host, args.port))
+    server.listen(1)
+    print('virtual device listening on {}:{}'.format(args.host, args.port))
+
+    # Settings kept from one connection to the next, like the EEPROM.
+    store = {}
+    while True:
+        conn, addr = server.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        print('host connected from {}:{}'.format(*addr))
+        VirtualDevice(conn, args, store).run()
+        conn.close()
+        print('host disconnected')
+
+
+if __name__ == '__main__':
+    main()